@@ -0,0 +1,32 @@
+#include "arena.h"
+#include "sim.h"
+#include <stdlib.h>
+#include <sys/mman.h>
+
+// Arenas of at least this size are aligned for, and advised to use, huge
+// pages, which cuts the TLB misses of large networks.
+#define ARENA_HUGE_PAGE (2ul << 20)
+
+void arena_init(Arena *a, size_t cap)
+{
+    size_t align = (cap >= ARENA_HUGE_PAGE) ? ARENA_HUGE_PAGE : ARENA_ALIGN;
+    void *p = NULL;
+    if (posix_memalign(&p, align, cap ? cap : 1) != 0) {
+        fatal("cannot allocate %zu bytes of node state\n", cap);
+    }
+#ifdef MADV_HUGEPAGE
+    if (cap >= ARENA_HUGE_PAGE) {
+        madvise(p, cap, MADV_HUGEPAGE);
+    }
+#endif
+    a->base = static_cast<char *>(p);
+    a->cap = cap;
+    a->used = 0;
+}
+
+void arena_free(Arena *a)
+{
+    free(a->base);
+    a->base = NULL;
+    a->cap = a->used = 0;
+}
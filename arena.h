@@ -0,0 +1,53 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <assert.h>
+#include <memory>
+#include <type_traits>
+
+// Bump allocator for state that lives exactly as long as its owner, e.g. all
+// nodes of a simulation.  Nothing is freed individually; arena_free() releases
+// everything at once, so only trivially destructible arrays are handed out
+// through arena_array().
+//
+// An arena without memory (base == NULL) only counts the bytes that the same
+// sequence of allocations would take, for sizing a real arena up front.
+
+#define ARENA_ALIGN 64 // cache line
+
+struct Arena {
+    char *base = NULL; // NULL if only counting
+    size_t cap = 0;
+    size_t used = 0;
+};
+
+void arena_init(Arena *a, size_t cap);
+void arena_free(Arena *a);
+
+// Returns NULL for a counting arena.
+static inline void *arena_alloc(Arena *a, size_t size, size_t align)
+{
+    size_t start = (a->used + align - 1) & ~(align - 1);
+    a->used = start + size;
+    if (!a->base) {
+        return NULL;
+    }
+    assert(a->used <= a->cap && "arena overflow");
+    return a->base + start;
+}
+
+template <class T>
+static inline T *arena_array(Arena *a, size_t n, const T &init)
+{
+    static_assert(std::is_trivially_destructible<T>::value,
+                  "arena arrays are never destructed");
+    T *p = static_cast<T *>(arena_alloc(a, n * sizeof(T), alignof(T)));
+    if (p) {
+        std::uninitialized_fill_n(p, n, init);
+    }
+    return p;
+}
+
+#endif
@@ -0,0 +1,531 @@
+// Micro and macro benchmarks of the simulator.
+//
+// Micro benchmarks time one hot component in isolation and report ns per
+// operation; each one is repeated with doubling iteration counts until it
+// runs for at least BENCH_MIN_NS.  Macro benchmarks run whole simulations
+// with a fixed seed and report simulated cycles per wall second, along with
+// the resulting statistics so that a change in behavior is noticed as well.
+//
+// With -check, runs a few simulations and fails unless their statistics
+// match the reference ones recorded below exactly.  Those without VC
+// contention are also run in lockstep, where every node ticks in every cycle,
+// and must match it: a node that sleeps through a cycle it had work in shows
+// up as a difference.  A trace dumped with -trace-dump must also replay.
+//
+// Usage: netsim_bench [-filter SUBSTR] [-cycles N] [-check]
+
+#include "sim.h"
+#include "router.h"
+#include "queue.h"
+#include "profile.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+
+#define BENCH_MIN_NS 200000000ull
+
+// Keeps the benchmarked computations from being optimized away.
+static volatile long sink;
+
+typedef long (*MicroFn)(long iters);
+
+//
+// Micro benchmarks
+//
+
+// Hold-model event queue: pop the earliest event and schedule it again a
+// little later, with a constant number of pending events.
+static long micro_eventq(long iters)
+{
+    const int pending = 1024;
+    EventQueue eq;
+    eventq_init(&eq);
+    eq.time_ = 0;
+    Philox rng(1);
+    for (int i = 0; i < pending; i++) {
+        schedule(&eq, rng() % 64, tick_event_from_id(rtr_id(i)));
+    }
+    long sum = 0;
+    for (long i = 0; i < iters; i++) {
+        Event e = eventq_pop(&eq);
+        sum += e.id.value;
+        reschedule(&eq, 1 + rng() % 64, e);
+    }
+    eventq_destroy(&eq);
+    return sum;
+}
+
+// queue.h ring buffer: fill up and drain, one put and one pop per op.
+static long micro_queue(long iters)
+{
+    Ring<long> q;
+    ring_init(&q, 16, false);
+    long sum = 0;
+    for (long i = 0; i < iters;) {
+        while (!ring_full(&q) && i < iters) {
+            ring_put(&q, i);
+            i++;
+        }
+        while (!ring_empty(&q)) {
+            sum += ring_pop(&q);
+        }
+    }
+    ring_free(&q);
+    return sum;
+}
+
+// A router in the middle of a 4-ary 2-torus with a body flit waiting in every
+// input VC, each routed to a different output port than it came from.
+static Sim *bench_router_create(Router **out)
+{
+    SimConfig cfg;
+    cfg.quiet = true;
+    Sim *sim = sim_create(&cfg);
+    // Away from the datelines in both dimensions.
+    Router *r = sim->routers[5];
+    for (int iport = 0; iport < r->radix; iport++) {
+        for (int vc = 0; vc < r->vc_count; vc++) {
+            int ivc = vc_index(r, iport, vc);
+            Flit *flit = new Flit(FLIT_BODY, vc, 0, 1, PacketId{0, iport}, 1);
+            ivc_put(r->ivcs, ivc, flit);
+            r->ivcs.route_port[ivc] = iport % (r->radix - 1) + 1;
+        }
+    }
+    *out = r;
+    return sim;
+}
+
+// VC allocation with every input VC requesting.  Grants only take effect in
+// update_states(), so every call sees the same requests.
+static long micro_vc_alloc(long iters)
+{
+    Router *r;
+    Sim *sim = bench_router_create(&r);
+    InputVCs &iv = r->ivcs;
+    for (int ivc = 0; ivc < iv.count; ivc++) {
+        iv.global[ivc] = STATE_VCWAIT;
+        bitmap_set(iv.vcwait_set, ivc);
+    }
+    for (long i = 0; i < iters; i++) {
+        vc_alloc(r);
+    }
+    long sum = r->stall_count[STALL_VA];
+    sim_destroy(sim);
+    return sum;
+}
+
+// Switch allocation with every input VC active and requesting.  The granted
+// flits are put back after each call, and the state changes are dropped.
+static long micro_switch_alloc(long iters)
+{
+    Router *r;
+    Sim *sim = bench_router_create(&r);
+    InputVCs &iv = r->ivcs;
+    OutputVCs &ov = r->ovcs;
+    for (int iport = 0; iport < r->radix; iport++) {
+        for (int vc = 0; vc < r->vc_count; vc++) {
+            int ivc = vc_index(r, iport, vc);
+            iv.global[ivc] = STATE_ACTIVE;
+            bitmap_set(iv.active_set, ivc);
+            iv.stage[ivc] = PIPELINE_SA;
+            iv.output_vc[ivc] = vc;
+            int ovc = vc_index(r, iv.route_port[ivc], vc);
+            ov.global[ovc] = STATE_ACTIVE;
+            ov.credit_count[ovc] = INT_MAX;
+        }
+    }
+    for (long i = 0; i < iters; i++) {
+        switch_alloc(r);
+        for (int ivc = 0; ivc < iv.count; ivc++) {
+            if (iv.st_ready[ivc]) {
+                ivc_put(iv, ivc, iv.st_ready[ivc]);
+                iv.st_ready[ivc] = NULL;
+                bitmap_clear(iv.st_ready_set, ivc);
+            }
+        }
+    }
+    long sum = r->stall_count[STALL_SA];
+    sim_destroy(sim);
+    return sum;
+}
+
+// Source route computation between random pairs of an 8-ary 2-torus.
+static long micro_route(long iters)
+{
+    SimConfig cfg;
+    cfg.quiet = true;
+    cfg.k = 8;
+    Sim *sim = sim_create(&cfg);
+    Router *src = sim->src_nodes[0];
+    Philox rng(1);
+    long sum = 0;
+    for (long i = 0; i < iters; i++) {
+        int s = rng() % 64;
+        int d = rng() % 64;
+        sum += source_route_compute(src, src->top_desc, s, d).size();
+    }
+    sim_destroy(sim);
+    return sum;
+}
+
+// The state scans of route_compute, credit_update and update_states over every
+// router of an idle 16-ary 2-torus, one router per op: the fixed cost of a
+// tick that finds nothing to do.
+static long micro_state_scan(long iters)
+{
+    SimConfig cfg;
+    cfg.quiet = true;
+    cfg.k = 16;
+    Sim *sim = sim_create(&cfg);
+    long n = sim->routers.size();
+    long sum = 0;
+    for (long i = 0; i < iters; i++) {
+        Router *r = sim->routers[i % n];
+        route_compute(r);
+        credit_update(r);
+        update_states(r);
+        sum += r->reschedule_next_tick;
+    }
+    sim_destroy(sim);
+    return sum;
+}
+
+// A flit through a 1-cycle channel: put, wake up the receiver, get.
+static long micro_channel(long iters)
+{
+    EventQueue eq;
+    eventq_init(&eq);
+    eq.time_ = 0;
+    Connection conn = not_connected;
+    conn.src = RouterPortPair{rtr_id(0), 1};
+    conn.dst = RouterPortPair{rtr_id(1), 2};
+    conn.link = default_link;
+    long sum = 0;
+    {
+        Channel ch(&eq, conn);
+        Flit flit(FLIT_BODY, 0, 0, 1, PacketId{0, 0}, 1);
+        for (long i = 0; i < iters; i++) {
+            channel_put(&ch, &flit);
+            eventq_pop(&eq);
+            sum += channel_get(&ch)->flitnum;
+        }
+    }
+    eventq_destroy(&eq);
+    return sum;
+}
+
+struct MicroBench {
+    const char *name;
+    MicroFn fn;
+};
+
+static const MicroBench micro_benches[] = {
+    {"micro/eventq", micro_eventq},
+    {"micro/queue", micro_queue},
+    {"micro/vc_alloc", micro_vc_alloc},
+    {"micro/switch_alloc", micro_switch_alloc},
+    {"micro/route", micro_route},
+    {"micro/state_scan", micro_state_scan},
+    {"micro/channel", micro_channel},
+};
+
+static void run_micro(const MicroBench *b)
+{
+    long iters = 1;
+    uint64_t ns;
+    while (true) {
+        uint64_t start = prof_clock();
+        sink = b->fn(iters);
+        ns = prof_clock() - start;
+        if (ns >= BENCH_MIN_NS) {
+            break;
+        }
+        iters *= 2;
+    }
+    printf("%-28s %12ld ops %10.1f ns/op\n", b->name, iters,
+           static_cast<double>(ns) / iters);
+}
+
+//
+// Macro benchmarks
+//
+
+struct MacroBench {
+    const char *name;
+    int k, r;
+    double rate; // flits/cycle/node
+};
+
+// Uniform random traffic at zero load, half the saturation throughput and
+// saturation.  The 8-ary 2-torus saturates at about 0.6 and the 4-ary 3-torus
+// at about 0.9 flits/cycle/node.
+static const MacroBench macro_benches[] = {
+    {"macro/8x2/zero-load", 8, 2, 0.02},
+    {"macro/8x2/half-sat", 8, 2, 0.3},
+    {"macro/8x2/saturation", 8, 2, 0.6},
+    {"macro/4x3/zero-load", 4, 3, 0.02},
+    {"macro/4x3/half-sat", 4, 3, 0.45},
+    {"macro/4x3/saturation", 4, 3, 0.9},
+};
+
+static void run_macro(const MacroBench *b, long cycles)
+{
+    SimConfig cfg;
+    cfg.quiet = true;
+    cfg.seed = 1;
+    cfg.k = b->k;
+    cfg.r = b->r;
+    cfg.rate = b->rate;
+    cfg.cycles = cycles;
+
+    uint64_t start = prof_clock();
+    Sim *sim = sim_create(&cfg);
+    sim_run(sim);
+    double secs = (prof_clock() - start) / 1e9;
+    SimResult res = sim_result(sim);
+    sim_destroy(sim);
+
+    printf("%-28s %8ld cycles %8.3f s %10.0f cycles/s  "
+           "accepted %.4f latency %.2f p99 %ld\n",
+           b->name, res.cycles, secs, res.cycles / secs, res.accepted,
+           res.latency_mean, res.latency_p99);
+}
+
+//
+// Reference and lockstep checks
+//
+
+// Length of the check runs that the reference statistics were recorded at.
+#define CHECK_REF_CYCLES 3000
+
+// Statistics of a check run, compared exactly.
+struct CheckStats {
+    long cycles;
+    long packet_count;
+    long latency_sum;
+    long hop_count_sum;
+    long latency_p50, latency_p99, latency_p999, latency_max;
+    long flits_departed, flits_arrived;
+};
+
+struct CheckRun {
+    const char *name;
+    SimConfig cfg;
+    CheckStats ref; // event-driven statistics at CHECK_REF_CYCLES
+    bool lockstep;  // whether the lockstep run must match as well
+};
+
+// Open-loop traffic only: closed-loop replies draw from the source's random
+// stream in the destination's tick, so their order within a cycle matters.
+//
+// The reference statistics were recorded from the tree before idle nodes
+// stopped ticking themselves.  wide-slow-drain was recorded again once
+// drained runs ended on a cycle boundary and sources generated flits at the
+// terminal width.
+//
+// Saturation is not run in lockstep: there, a VC bidding for a busy output VC
+// moves the round-robin pointer of its VA input arbiter in cycles that the
+// event-driven router sleeps through.
+static std::vector<CheckRun> check_runs(long cycles)
+{
+    std::vector<CheckRun> runs;
+    SimConfig cfg;
+    cfg.quiet = true;
+    cfg.seed = 1;
+    cfg.cycles = cycles;
+
+    cfg.k = 8;
+    cfg.rate = 0.02;
+    runs.push_back({"check/8x2/zero-load", cfg,
+                    {3000, 922, 28001, 3764, 30, 50, 50, 51, 3727, 3693},
+                    true});
+    cfg.rate = 0.6;
+    runs.push_back({"check/8x2/saturation", cfg,
+                    {3000, 27899, 2101074, 117346, 54, 375, 487, 570, 113954,
+                     111692},
+                    false});
+
+    cfg.k = 4;
+    cfg.r = 3;
+    cfg.rate = 0.45;
+    cfg.packet_len = packet_len_bimodal(1, 8, 0.5);
+    runs.push_back({"check/4x3/bimodal", cfg,
+                    {3000, 19080, 570660, 58724, 29, 58, 77, 113, 85964,
+                     85191},
+                    true});
+
+    cfg.r = 2;
+    cfg.rate = 0.3;
+    cfg.packet_len = packet_len_fixed(3);
+    cfg.inj_type = INJ_ONOFF;
+    cfg.burst = 8.0;
+    runs.push_back({"check/4x2/onoff", cfg,
+                    {3000, 4655, 109458, 10069, 23, 40, 46, 58, 14079, 13969},
+                    true});
+
+    cfg.inj_type = INJ_POISSON;
+    cfg.rate = 0.5;
+    cfg.term_link = LinkDesc{2, 2};
+    cfg.dim_links = {LinkDesc{3, 2}};
+    cfg.warmup = cycles / 4;
+    cfg.measure = cycles / 2;
+    runs.push_back({"check/4x2/wide-slow-drain", cfg,
+                    {2284, 4092, 110351, 13287, 26, 42, 47, 55, 18671, 18469},
+                    true});
+    return runs;
+}
+
+static CheckStats check_sim(const SimConfig &cfg, bool lockstep)
+{
+    SimConfig c = cfg;
+    c.lockstep = lockstep;
+    Sim *sim = sim_create(&c);
+    sim_run(sim);
+    SimResult res = sim_result(sim);
+    CheckStats cs;
+    cs.cycles = res.cycles;
+    cs.packet_count = res.packet_count;
+    cs.latency_sum = sim->stat.latency_sum;
+    cs.hop_count_sum = sim->stat.hop_count_sum;
+    cs.latency_p50 = res.latency_p50;
+    cs.latency_p99 = res.latency_p99;
+    cs.latency_p999 = res.latency_p999;
+    cs.latency_max = res.latency_max;
+    cs.flits_departed = 0;
+    cs.flits_arrived = 0;
+    for (size_t i = 0; i < sim->src_nodes.size(); i++) {
+        cs.flits_departed += sim->src_nodes[i]->flit_depart_count;
+        cs.flits_arrived += sim->dst_nodes[i]->flit_arrive_count;
+    }
+    sim_destroy(sim);
+    return cs;
+}
+
+static bool check_stats_equal(const CheckStats &a, const CheckStats &b)
+{
+    return a.cycles == b.cycles && a.packet_count == b.packet_count &&
+           a.latency_sum == b.latency_sum &&
+           a.hop_count_sum == b.hop_count_sum &&
+           a.latency_p50 == b.latency_p50 && a.latency_p99 == b.latency_p99 &&
+           a.latency_p999 == b.latency_p999 &&
+           a.latency_max == b.latency_max &&
+           a.flits_departed == b.flits_departed &&
+           a.flits_arrived == b.flits_arrived;
+}
+
+// Returns true if the event-driven run matches the reference statistics, when
+// run at their length, and the lockstep run.
+static bool run_check(const CheckRun *run)
+{
+    CheckStats x = check_sim(run->cfg, false);
+    const char *ref = "-   ", *lockstep = "-   ";
+    bool ok = true;
+    if (run->cfg.cycles == CHECK_REF_CYCLES) {
+        bool same = check_stats_equal(x, run->ref);
+        ref = same ? "ok  " : "FAIL";
+        ok &= same;
+    }
+    if (run->lockstep) {
+        bool same = check_stats_equal(x, check_sim(run->cfg, true));
+        lockstep = same ? "ok  " : "FAIL";
+        ok &= same;
+    }
+    printf("%-28s ref %s lockstep %s latency sum %ld packets %ld\n",
+           run->name, ref, lockstep, x.latency_sum, x.packet_count);
+    return ok;
+}
+
+// Dump the packets of a Bernoulli run, whose busy sources generate packets
+// later than they arrive, and replay the dump.  Returns true if the replay
+// takes the dump and generates every packet in it.
+static bool run_trace_check(const char *name, long cycles)
+{
+    char path[] = "/tmp/netsim-check-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return false;
+    }
+    close(fd);
+
+    SimConfig cfg;
+    cfg.quiet = true;
+    cfg.seed = 1;
+    cfg.cycles = cycles;
+    cfg.inj_type = INJ_BERNOULLI;
+    cfg.rate = 0.6;
+    cfg.packet_len = packet_len_bimodal(1, 8, 0.5);
+    cfg.trace_dump = trace_writer_open(path);
+    Sim *sim = sim_create(&cfg);
+    sim_run(sim);
+    long dumped = sim->stat.packet_gen_count;
+    sim_destroy(sim);
+    trace_writer_close(cfg.trace_dump);
+
+    // Give the backlog of the last cycles time to be generated.
+    SimConfig replay;
+    replay.quiet = true;
+    replay.seed = 1;
+    replay.cycles = 2 * cycles;
+    replay.trace = trace_open(path, replay.k * replay.k, 1000);
+    sim = sim_create(&replay);
+    sim_run(sim);
+    long replayed = sim->stat.packet_gen_count;
+    sim_destroy(sim);
+    trace_close(replay.trace);
+    unlink(path);
+
+    bool same = replayed == dumped;
+    printf("%-28s %s  packets %ld/%ld\n", name, same ? "ok  " : "FAIL",
+           replayed, dumped);
+    return same;
+}
+
+int main(int argc, char **argv)
+{
+    const char *filter = "";
+    long cycles = CHECK_REF_CYCLES;
+    bool check = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-filter") && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (!strcmp(argv[i], "-cycles") && i + 1 < argc) {
+            cycles = std::stol(std::string(argv[++i]));
+        } else if (!strcmp(argv[i], "-check")) {
+            check = true;
+        } else {
+            fprintf(stderr,
+                    "usage: %s [-filter SUBSTR] [-cycles N] [-check]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    if (check) {
+        int failed = 0;
+        for (const CheckRun &run : check_runs(cycles)) {
+            if (strstr(run.name, filter)) {
+                failed += !run_check(&run);
+            }
+        }
+        const char *trace_name = "check/4x2/trace-replay";
+        if (strstr(trace_name, filter)) {
+            failed += !run_trace_check(trace_name, cycles);
+        }
+        return failed ? 1 : 0;
+    }
+
+    for (const MicroBench &b : micro_benches) {
+        if (strstr(b.name, filter)) {
+            run_micro(&b);
+        }
+    }
+    for (const MacroBench &b : macro_benches) {
+        if (strstr(b.name, filter)) {
+            run_macro(&b, cycles);
+        }
+    }
+    return 0;
+}
@@ -79,3 +79,8 @@ int eventq_empty(const EventQueue *eq)
 {
     return pqueue_size(eq->pq) == 0;
 }
+
+size_t eventq_size(const EventQueue *eq)
+{
+    return pqueue_size(eq->pq);
+}
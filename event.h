@@ -56,6 +56,7 @@ void eventq_init(EventQueue *eq);
 void eventq_destroy(EventQueue *eq);
 Event eventq_pop(EventQueue *eq);
 int eventq_empty(const EventQueue *eq);
+size_t eventq_size(const EventQueue *eq);
 void schedule(EventQueue *eq, long time, Event e);
 void reschedule(EventQueue *eq, long reltime, Event e);
 long curr_time(const EventQueue *eq);
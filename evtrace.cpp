@@ -0,0 +1,44 @@
+#include "evtrace.h"
+#include "sim.h"
+#include <string.h>
+
+EvTrace *evtrace_open(const char *path)
+{
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        fatal("cannot open event trace %s\n", path);
+    }
+    EvTraceHeader hdr{};
+    memcpy(hdr.magic, EVTRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = EVTRACE_VERSION;
+    hdr.record_size = sizeof(EvRecord);
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1) {
+        fatal("cannot write event trace %s\n", path);
+    }
+
+    EvTrace *t = new EvTrace;
+    t->file = f;
+    t->count = 0;
+    t->total = 0;
+    t->buf = new EvRecord[EVTRACE_BUF_RECORDS];
+    return t;
+}
+
+void evtrace_flush(EvTrace *t)
+{
+    if (t->count > 0 &&
+        fwrite(t->buf, sizeof(EvRecord), t->count, t->file) !=
+            static_cast<size_t>(t->count)) {
+        fatal("cannot write event trace\n");
+    }
+    t->total += t->count;
+    t->count = 0;
+}
+
+void evtrace_close(EvTrace *t)
+{
+    evtrace_flush(t);
+    fclose(t->file);
+    delete[] t->buf;
+    delete t;
+}
@@ -0,0 +1,83 @@
+#ifndef EVTRACE_H
+#define EVTRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Binary trace of per-flit pipeline events.
+//
+// An event trace file is an EvTraceHeader followed by EvRecords in the order
+// they happened, in native byte order.  The exception is EV_GEN: it is
+// recorded when the flit is sent, but stamped with the earlier cycle that the
+// flit was generated in.  Every simulation owns its recorder
+// and buffer, so simulations on different threads never contend.  Records
+// are buffered in memory and written out in large chunks; use the
+// netsim-evtrace tool to turn them into pipeline diagrams or Chrome trace
+// JSON.
+
+#define EVTRACE_MAGIC "NSIMEVT1"
+#define EVTRACE_VERSION 2
+// Number of records buffered before a write.
+#define EVTRACE_BUF_RECORDS (1 << 16)
+
+enum EvKind {
+    EV_GEN,    // flit generated at the source
+    EV_INJECT, // flit put on the injection channel
+    EV_BW,     // flit taken off a channel into an input buffer
+    EV_RC,     // route computation
+    EV_VA,     // VC allocation; 'port'/'vc' are the output ones
+    EV_SA,     // switch allocation
+    EV_ST,     // switch traversal onto the output channel
+    EV_EJECT,  // flit consumed at the destination
+    EV_CREDIT, // credit sent upstream for input 'port'/'vc'; no flit
+    EV_KIND_COUNT,
+};
+
+struct EvTraceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size; // sizeof(EvRecord)
+};
+
+struct EvRecord {
+    int64_t time;
+    int64_t packet_id; // -1 if there is no flit
+    int32_t packet_src;
+    int32_t node;      // ID value of the node
+    int32_t flitnum;
+    uint8_t node_type; // IdType of the node
+    uint8_t kind;      // EvKind
+    uint16_t port;
+    uint16_t vc;
+    uint8_t pad[6]; // zero, so that records have no uninitialized bytes
+};
+static_assert(sizeof(EvRecord) == 40, "EvRecord is written to disk as is");
+
+struct EvTrace {
+    FILE *file;
+    long count; // records in 'buf'
+    long total; // records written so far
+    EvRecord *buf;
+};
+
+EvTrace *evtrace_open(const char *path);
+void evtrace_flush(EvTrace *t);
+void evtrace_close(EvTrace *t);
+
+static inline const char *evtrace_kind_str(int kind)
+{
+    static const char *names[EV_KIND_COUNT] = {
+        "GEN", "INJ", "BW", "RC", "VA", "SA", "ST", "EJ", "CR",
+    };
+    return (0 <= kind && kind < EV_KIND_COUNT) ? names[kind] : "??";
+}
+
+static inline void evtrace_put(EvTrace *t, const EvRecord &rec)
+{
+    t->buf[t->count++] = rec;
+    if (t->count == EVTRACE_BUF_RECORDS) {
+        evtrace_flush(t);
+    }
+}
+
+#endif
@@ -0,0 +1,227 @@
+// netsim-evtrace: offline converter for the pipeline event traces recorded
+// with 'netsim -evtrace'.
+//
+//   netsim-evtrace pipeline <trace> [-packet src:id] [-from C] [-to C]
+//                                   [-max-flits N]
+//       Prints a pipeline diagram: one row per flit, one column per cycle in
+//       which any of the shown flits did something.  Each cell is the stage
+//       and the node it happened at, e.g. "VA5".
+//
+//   netsim-evtrace chrome <trace> [-from C] [-to C]
+//       Prints Chrome/Perfetto trace JSON: one process per node, one thread
+//       per port, one 1-cycle slice per event (1 cycle = 1 us).
+
+#include "evtrace.h"
+#include "event.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+// Width of a pipeline diagram cell.
+#define CELL_WIDTH 8
+
+struct FlitKey {
+    int32_t src;
+    int64_t id;
+    int32_t flitnum;
+};
+
+static inline bool operator<(const FlitKey &a, const FlitKey &b)
+{
+    if (a.src != b.src) return a.src < b.src;
+    if (a.id != b.id) return a.id < b.id;
+    return a.flitnum < b.flitnum;
+}
+
+static void die(const char *msg)
+{
+    fprintf(stderr, "netsim-evtrace: %s\n", msg);
+    exit(EXIT_FAILURE);
+}
+
+static FILE *open_trace(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        die("cannot open trace");
+    }
+    EvTraceHeader hdr;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+        memcmp(hdr.magic, EVTRACE_MAGIC, sizeof(hdr.magic)) != 0) {
+        die("not an event trace");
+    }
+    if (hdr.version != EVTRACE_VERSION || hdr.record_size != sizeof(EvRecord)) {
+        die("unsupported event trace version");
+    }
+    return f;
+}
+
+// Calls 'fn' on every record within [from, to].  The whole trace is read:
+// EV_GEN records are back-dated, so a record within range may follow one
+// past 'to'.
+template <typename F>
+static void for_each_record(FILE *f, long from, long to, F fn)
+{
+    static EvRecord buf[4096];
+    size_t n;
+    while ((n = fread(buf, sizeof(EvRecord), 4096, f)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            if (buf[i].time < from || buf[i].time > to) {
+                continue;
+            }
+            fn(buf[i]);
+        }
+    }
+}
+
+static char node_char(int type)
+{
+    return type == ID_SRC ? 'S' : type == ID_DST ? 'D' : 'R';
+}
+
+static void pipeline(FILE *f, long from, long to, bool has_packet,
+                     FlitKey packet, size_t max_flits)
+{
+    // Flits in order of first appearance.
+    std::vector<FlitKey> order;
+    std::map<FlitKey, std::map<long, std::string>> cells;
+    std::set<long> cycles;
+
+    for_each_record(f, from, to, [&](const EvRecord &rec) {
+        if (rec.packet_id < 0) {
+            return;
+        }
+        if (has_packet &&
+            (rec.packet_src != packet.src || rec.packet_id != packet.id)) {
+            return;
+        }
+        FlitKey key{rec.packet_src, rec.packet_id, rec.flitnum};
+        auto it = cells.find(key);
+        if (it == cells.end()) {
+            if (order.size() >= max_flits) {
+                return;
+            }
+            order.push_back(key);
+            it = cells.insert({key, {}}).first;
+        }
+        char cell[32];
+        if (rec.node_type == ID_RTR) {
+            snprintf(cell, sizeof(cell), "%s%d", evtrace_kind_str(rec.kind),
+                     rec.node);
+        } else {
+            snprintf(cell, sizeof(cell), "%s", evtrace_kind_str(rec.kind));
+        }
+        std::string &s = it->second[rec.time];
+        s += s.empty() ? cell : std::string("/") + cell;
+        cycles.insert(rec.time);
+    });
+
+    printf("%-14s|", "flit");
+    for (long c : cycles) {
+        printf("%*ld", CELL_WIDTH, c);
+    }
+    printf("\n");
+    for (const FlitKey &key : order) {
+        char name[32];
+        snprintf(name, sizeof(name), "s%d.p%ld.f%d", key.src,
+                 static_cast<long>(key.id), key.flitnum);
+        printf("%-14s|", name);
+        const auto &row = cells[key];
+        for (long c : cycles) {
+            auto it = row.find(c);
+            std::string s = (it == row.end()) ? "." : it->second;
+            if (s.size() > CELL_WIDTH - 1) {
+                s = s.substr(0, CELL_WIDTH - 2) + "+";
+            }
+            printf("%*s", CELL_WIDTH, s.c_str());
+        }
+        printf("\n");
+    }
+}
+
+static void chrome(FILE *f, long from, long to)
+{
+    std::set<std::pair<int, int>> nodes;
+    bool first = true;
+
+    printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for_each_record(f, from, to, [&](const EvRecord &rec) {
+        int pid = rec.node_type * 1000000 + rec.node;
+        nodes.insert({rec.node_type, rec.node});
+        printf("%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%ld,\"dur\":1,"
+               "\"pid\":%d,\"tid\":%d,\"args\":{",
+               first ? "" : ",\n", evtrace_kind_str(rec.kind),
+               static_cast<long>(rec.time), pid, rec.port);
+        if (rec.packet_id >= 0) {
+            printf("\"flit\":\"s%d.p%ld.f%d\",", rec.packet_src,
+                   static_cast<long>(rec.packet_id), rec.flitnum);
+        }
+        printf("\"vc\":%d}}", rec.vc);
+        first = false;
+    });
+    for (const auto &n : nodes) {
+        printf("%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+               "\"args\":{\"name\":\"%c%d\"}}",
+               first ? "" : ",\n", n.first * 1000000 + n.second,
+               node_char(n.first), n.second);
+        first = false;
+    }
+    printf("\n]}\n");
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: netsim-evtrace pipeline <trace> [-packet src:id] "
+            "[-from C] [-to C] [-max-flits N]\n"
+            "       netsim-evtrace chrome <trace> [-from C] [-to C]\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3) {
+        usage();
+    }
+    const char *mode = argv[1];
+    long from = 0, to = __LONG_MAX__;
+    bool has_packet = false;
+    FlitKey packet{0, 0, 0};
+    size_t max_flits = 64;
+
+    for (int i = 3; i < argc; i++) {
+        if (!strcmp(argv[i], "-from") && i + 1 < argc) {
+            from = atol(argv[++i]);
+        } else if (!strcmp(argv[i], "-to") && i + 1 < argc) {
+            to = atol(argv[++i]);
+        } else if (!strcmp(argv[i], "-max-flits") && i + 1 < argc) {
+            max_flits = atol(argv[++i]);
+        } else if (!strcmp(argv[i], "-packet") && i + 1 < argc) {
+            long src, id;
+            if (sscanf(argv[++i], "%ld:%ld", &src, &id) != 2) {
+                usage();
+            }
+            packet.src = src;
+            packet.id = id;
+            has_packet = true;
+        } else {
+            usage();
+        }
+    }
+
+    FILE *f = open_trace(argv[2]);
+    if (!strcmp(mode, "pipeline")) {
+        pipeline(f, from, to, has_packet, packet, max_flits);
+    } else if (!strcmp(mode, "chrome")) {
+        chrome(f, from, to);
+    } else {
+        usage();
+    }
+    fclose(f);
+
+    return 0;
+}
@@ -0,0 +1,67 @@
+#include "hist.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+void hist_init(Hist *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+void hist_merge(Hist *dst, const Hist *src)
+{
+    if (src->count == 0) {
+        return;
+    }
+    if (dst->count == 0 || src->min < dst->min) dst->min = src->min;
+    if (dst->count == 0 || src->max > dst->max) dst->max = src->max;
+    dst->count += src->count;
+    dst->sum += src->sum;
+    for (int i = 0; i < HIST_BUCKET_COUNT; i++) {
+        dst->buckets[i] += src->buckets[i];
+    }
+}
+
+double hist_mean(const Hist *h)
+{
+    return h->count ? static_cast<double>(h->sum) / h->count : 0.0;
+}
+
+// Upper bound of the values that fall into bucket 'b'.
+static long bucket_high(int b)
+{
+    if (b < 2 * HIST_SUB_COUNT) {
+        return b;
+    }
+    int shift = b / HIST_SUB_COUNT - 1;
+    long mantissa = b % HIST_SUB_COUNT + HIST_SUB_COUNT;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+// Returns the smallest recorded value such that 'p' percent of the values are
+// less than or equal to it, within the bucket precision.
+long hist_percentile(const Hist *h, double p)
+{
+    if (h->count == 0) {
+        return 0;
+    }
+    long rank = static_cast<long>(p / 100.0 * h->count + 0.5);
+    rank = std::max(1L, std::min(rank, h->count));
+    long seen = 0;
+    for (int b = 0; b < HIST_BUCKET_COUNT; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank) {
+            return std::min(bucket_high(b), h->max);
+        }
+    }
+    return h->max;
+}
+
+void hist_print(const char *name, const Hist *h)
+{
+    printf("%s: mean %.2lf, p50 %ld, p99 %ld, p99.9 %ld, max %ld (%ld "
+           "samples)\n",
+           name, hist_mean(h), hist_percentile(h, 50.0),
+           hist_percentile(h, 99.0), hist_percentile(h, 99.9), h->max,
+           h->count);
+}
@@ -0,0 +1,53 @@
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdint.h>
+
+// Log-linear latency histogram, in the spirit of HdrHistogram.
+//
+// Values below 2^(HIST_SUB_BITS+1) get a bucket of their own.  Above that,
+// each power of two is split into 2^HIST_SUB_BITS equal buckets, so that the
+// relative error of a recorded value is below 2^-HIST_SUB_BITS (~3%).  Memory
+// is fixed and recording is O(1).  Values beyond 2^HIST_MAX_BITS are clamped.
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 32
+#define HIST_BUCKET_COUNT ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+typedef struct Hist {
+    long count;
+    long sum;
+    long min;
+    long max;
+    long buckets[HIST_BUCKET_COUNT];
+} Hist;
+
+static inline int hist_bucket(long v)
+{
+    if (v < 2 * HIST_SUB_COUNT) {
+        return v < 0 ? 0 : static_cast<int>(v);
+    }
+    if (v >= (1L << HIST_MAX_BITS)) {
+        return HIST_BUCKET_COUNT - 1;
+    }
+    int shift = (63 - __builtin_clzl(v)) - HIST_SUB_BITS;
+    return shift * HIST_SUB_COUNT + static_cast<int>(v >> shift);
+}
+
+static inline void hist_record(Hist *h, long v)
+{
+    if (h->count == 0 || v < h->min) h->min = v;
+    if (h->count == 0 || v > h->max) h->max = v;
+    h->count++;
+    h->sum += v;
+    h->buckets[hist_bucket(v)]++;
+}
+
+void hist_init(Hist *h);
+void hist_merge(Hist *dst, const Hist *src);
+double hist_mean(const Hist *h);
+long hist_percentile(const Hist *h, double p);
+void hist_print(const char *name, const Hist *h);
+
+#endif
@@ -1,77 +1,341 @@
 #include "sim.h"
 #include "router.h"
 #include "queue.h"
+#include "sweep.h"
+#include <thread>
+
+// Parse a comma-separated list of integers, e.g. "1,4,4", into 'vals'.
+// Returns the number of parsed values.
+static int parse_long_list(const char *str, long *vals, int max)
+{
+    int n = 0;
+    const char *p = str;
+    while (*p && n < max) {
+        char *endptr;
+        vals[n++] = strtol(p, &endptr, 10);
+        if (*endptr != ',')
+            break;
+        p = endptr + 1;
+    }
+    return n;
+}
+
+// Same as parse_long_list(), for floating-point values.
+static int parse_double_list(const char *str, double *vals, int max)
+{
+    int n = 0;
+    const char *p = str;
+    while (*p && n < max) {
+        char *endptr;
+        vals[n++] = strtod(p, &endptr);
+        if (*endptr != ',')
+            break;
+        p = endptr + 1;
+    }
+    return n;
+}
+
+// Parse injection rates given either as a list, e.g. "0.1,0.2,0.4", or as a
+// range "start:step:end".
+static std::vector<double> parse_rate_range(const char *str)
+{
+    double start, step, end;
+    if (sscanf(str, "%lf:%lf:%lf", &start, &step, &end) == 3) {
+        if (step <= 0.0) {
+            fatal("invalid rate range '%s'\n", str);
+        }
+        std::vector<double> rates;
+        // Tolerate rounding errors at the end of the range.
+        for (int i = 0; start + i * step <= end + step * 1e-6; i++) {
+            rates.push_back(start + i * step);
+        }
+        return rates;
+    }
+    double vals[NORMALLEN];
+    int n = parse_double_list(str, vals, NORMALLEN);
+    return std::vector<double>(vals, vals + n);
+}
 
 int main(int argc, char **argv) {
-    int debug = 0;
-    bool verbose = false;
-    double mean_interval = 0.0;
-    long total_cycles = 10000;
-    // Default is 4-ary 2-torus.
-    int k = 4, r = 2;
-    int terminal_count;
-    int router_count;
-    int radix;
-    int vc_count = -1;
+    SimConfig cfg;
+    // Per-dimension link delay and width. The last given value is repeated
+    // for the remaining dimensions.
+    long dim_delays[NORMALLEN] = {1};
+    long dim_widths[NORMALLEN] = {1};
+    int dim_delay_count = 1, dim_width_count = 1;
+    long hotspot_ids[NORMALLEN] = {0};
+    int hotspot_count = 1;
+    const char *trace_path = NULL;
+    const char *trace_dump_path = NULL;
+    long trace_lookahead = 1000;
+    double mmpp_rates[MMPP_MAX_STATES] = {0};
+    double mmpp_dwells[MMPP_MAX_STATES] = {0};
+    int mmpp_rate_count = 0, mmpp_dwell_count = 0;
+    // Packet lengths and their relative weights.
+    long lens[NORMALLEN] = {4};
+    double len_weights[NORMALLEN] = {0};
+    int len_count = 1, len_weight_count = 0;
+    const char *len_hist_path = NULL;
+    // Injection rate sweep.
+    std::vector<double> sweep_rates;
+    int thread_count = std::max(1u, std::thread::hardware_concurrency());
+    const char *sweep_out_path = NULL;
 
     for (int i = 0; i < argc; i++) {
         if (!strcmp(argv[i], "-d")) {
-            debug = 1;
+            cfg.debug_mode = 1;
         } else if (!strcmp(argv[i], "-v")) {
-            verbose = true;
+            cfg.verbose = true;
+            if (!DEBUG_LOG_ENABLED) {
+                fprintf(stderr, "warning: debug logging is compiled out in "
+                                "this build\n");
+            }
         } else if (!strcmp(argv[i], "-k")) {
             i++;
-            k = std::stoi(std::string(argv[i]));
+            cfg.k = std::stoi(std::string(argv[i]));
         } else if (!strcmp(argv[i], "-r")) {
             i++;
-            r = std::stoi(std::string(argv[i]));
+            cfg.r = std::stoi(std::string(argv[i]));
         } else if (!strcmp(argv[i], "-vc")) {
             // VC can be overrided
             i++;
-            vc_count = std::stoi(std::string(argv[i]));
+            cfg.vc_count = std::stoi(std::string(argv[i]));
         } else if (!strcmp(argv[i], "-cycle")) {
             i++;
-            total_cycles = std::stoi(std::string(argv[i]));
+            cfg.cycles = std::stoi(std::string(argv[i]));
+        } else if (!strcmp(argv[i], "-seed")) {
+            i++;
+            cfg.seed = std::stoull(std::string(argv[i]));
         } else if (!strcmp(argv[i], "-interval")) {
             i++;
-            mean_interval = std::stod(std::string(argv[i]));
+            cfg.mean_interval = std::stod(std::string(argv[i]));
+        } else if (!strcmp(argv[i], "-delay")) {
+            i++;
+            dim_delay_count = parse_long_list(argv[i], dim_delays, NORMALLEN);
+        } else if (!strcmp(argv[i], "-width")) {
+            i++;
+            dim_width_count = parse_long_list(argv[i], dim_widths, NORMALLEN);
+        } else if (!strcmp(argv[i], "-term-delay")) {
+            i++;
+            cfg.term_link.delay = std::stol(std::string(argv[i]));
+        } else if (!strcmp(argv[i], "-term-width")) {
+            i++;
+            cfg.term_link.width = std::stoi(std::string(argv[i]));
+        } else if (!strcmp(argv[i], "-link")) {
+            // ROUTER:PORT:DELAY:WIDTH, may be given multiple times.
+            i++;
+            LinkOverride lo;
+            if (sscanf(argv[i], "%d:%d:%ld:%d", &lo.router, &lo.port,
+                       &lo.link.delay, &lo.link.width) != 4) {
+                fprintf(stderr, "error: invalid link override '%s'\n",
+                        argv[i]);
+                return 1;
+            }
+            cfg.link_overrides.push_back(lo);
+        } else if (!strcmp(argv[i], "-traffic")) {
+            i++;
+            if (!traffic_type_from_str(argv[i], &cfg.traffic_type)) {
+                fprintf(stderr, "error: unknown traffic pattern '%s'\n",
+                        argv[i]);
+                fprintf(stderr, "available patterns:");
+                for (int t = 0; t < TRF_COUNT; t++) {
+                    fprintf(stderr, " %s", traffic_str((TrafficType)t));
+                }
+                fprintf(stderr, "\n");
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "-hotspot")) {
+            i++;
+            hotspot_count = parse_long_list(argv[i], hotspot_ids, NORMALLEN);
+        } else if (!strcmp(argv[i], "-hotspot-rate")) {
+            i++;
+            cfg.hotspot_rate = std::stod(std::string(argv[i]));
+        } else if (!strcmp(argv[i], "-process")) {
+            i++;
+            if (!injection_type_from_str(argv[i], &cfg.inj_type)) {
+                fprintf(stderr, "error: unknown injection process '%s'\n",
+                        argv[i]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "-rate")) {
+            i++;
+            cfg.rate = std::stod(std::string(argv[i]));
+        } else if (!strcmp(argv[i], "-burst")) {
+            i++;
+            cfg.burst = std::stod(std::string(argv[i]));
+        } else if (!strcmp(argv[i], "-mmpp-rates")) {
+            i++;
+            mmpp_rate_count =
+                parse_double_list(argv[i], mmpp_rates, MMPP_MAX_STATES);
+        } else if (!strcmp(argv[i], "-mmpp-dwell")) {
+            i++;
+            mmpp_dwell_count =
+                parse_double_list(argv[i], mmpp_dwells, MMPP_MAX_STATES);
+        } else if (!strcmp(argv[i], "-len")) {
+            i++;
+            len_count = parse_long_list(argv[i], lens, NORMALLEN);
+        } else if (!strcmp(argv[i], "-len-weights")) {
+            i++;
+            len_weight_count =
+                parse_double_list(argv[i], len_weights, NORMALLEN);
+        } else if (!strcmp(argv[i], "-len-hist")) {
+            i++;
+            len_hist_path = argv[i];
+        } else if (!strcmp(argv[i], "-warmup")) {
+            i++;
+            cfg.warmup = std::stol(std::string(argv[i]));
+        } else if (!strcmp(argv[i], "-measure")) {
+            i++;
+            cfg.measure = std::stol(std::string(argv[i]));
+        } else if (!strcmp(argv[i], "-drain")) {
+            i++;
+            cfg.drain_max = std::stol(std::string(argv[i]));
+        } else if (!strcmp(argv[i], "-batch")) {
+            i++;
+            cfg.batch = std::stol(std::string(argv[i]));
+        } else if (!strcmp(argv[i], "-converge")) {
+            i++;
+            cfg.converge = std::stod(std::string(argv[i]));
+        } else if (!strcmp(argv[i], "-sweep")) {
+            i++;
+            sweep_rates = parse_rate_range(argv[i]);
+        } else if (!strcmp(argv[i], "-threads")) {
+            i++;
+            thread_count = std::stoi(std::string(argv[i]));
+        } else if (!strcmp(argv[i], "-sweep-out")) {
+            i++;
+            sweep_out_path = argv[i];
+        } else if (!strcmp(argv[i], "-pair-hist")) {
+            cfg.pair_hists = true;
+        } else if (!strcmp(argv[i], "-profile")) {
+            cfg.profile = true;
+        } else if (!strcmp(argv[i], "-lockstep")) {
+            cfg.lockstep = true;
+        } else if (!strcmp(argv[i], "-closed-loop")) {
+            cfg.closed_loop = true;
+        } else if (!strcmp(argv[i], "-reply-len")) {
+            i++;
+            cfg.reply_len = std::stol(std::string(argv[i]));
+        } else if (!strcmp(argv[i], "-max-outstanding")) {
+            i++;
+            cfg.max_outstanding = std::stoi(std::string(argv[i]));
+        } else if (!strcmp(argv[i], "-trace")) {
+            i++;
+            trace_path = argv[i];
+        } else if (!strcmp(argv[i], "-trace-dump")) {
+            i++;
+            trace_dump_path = argv[i];
+        } else if (!strcmp(argv[i], "-evtrace")) {
+            i++;
+            cfg.evtrace_path = argv[i];
+        } else if (!strcmp(argv[i], "-monitor")) {
+            i++;
+            cfg.monitor_path = argv[i];
+        } else if (!strcmp(argv[i], "-monitor-interval")) {
+            i++;
+            cfg.monitor_interval = std::stol(std::string(argv[i]));
+        } else if (!strcmp(argv[i], "-monitor-format")) {
+            i++;
+            if (!strcmp(argv[i], "csv")) {
+                cfg.monitor_format = MON_CSV;
+            } else if (!strcmp(argv[i], "bin")) {
+                cfg.monitor_format = MON_BINARY;
+            } else {
+                fprintf(stderr, "error: unknown monitor format '%s'\n",
+                        argv[i]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "-trace-lookahead")) {
+            i++;
+            trace_lookahead = std::stol(std::string(argv[i]));
         }
     }
 
-    router_count = 1;
-    for (int i = 0; i < r; i++) {
-        router_count *= k;
+    for (int i = 0; i < std::max(dim_delay_count, dim_width_count); i++) {
+        LinkDesc link;
+        link.delay = dim_delays[std::min(i, dim_delay_count - 1)];
+        link.width = dim_widths[std::min(i, dim_width_count - 1)];
+        cfg.dim_links.push_back(link);
     }
-    terminal_count = router_count;
-    // 1: terminal node, 2: bidirectional in each ring
-    radix = 1 + 2 * r;
-    if (vc_count == -1) {
-        // 2 VCs in each dimension
-        vc_count = 2 * r;
-    } // else, overrided
+    cfg.hotspots.assign(hotspot_ids, hotspot_ids + hotspot_count);
+    cfg.mmpp_rates.assign(mmpp_rates, mmpp_rates + mmpp_rate_count);
+    cfg.mmpp_dwells.assign(mmpp_dwells, mmpp_dwells + mmpp_dwell_count);
 
-    Topology top = topology_torus(k, r);
+    // Packet lengths: a single length, two lengths of a request/response
+    // mix, or an empirical histogram.  Unweighted lengths are equally likely.
+    if (len_hist_path) {
+        cfg.packet_len = packet_len_from_file(len_hist_path);
+    } else if (len_weight_count != 0 && len_weight_count != len_count) {
+        fprintf(stderr, "error: -len and -len-weights differ in length\n");
+        return 1;
+    } else {
+        if (len_weight_count == 0) {
+            std::fill(len_weights, len_weights + len_count, 1.0);
+        }
+        if (len_count == 1) {
+            cfg.packet_len = packet_len_fixed(lens[0]);
+        } else if (len_count == 2) {
+            cfg.packet_len = packet_len_bimodal(
+                lens[0], lens[1],
+                len_weights[0] / (len_weights[0] + len_weights[1]));
+        } else {
+            cfg.packet_len = packet_len_histogram(
+                std::vector<long>(lens, lens + len_count),
+                std::vector<double>(len_weights, len_weights + len_count));
+        }
+    }
 
-    Sim sim{verbose, debug, top, terminal_count, router_count, radix, vc_count, mean_interval, 10};
-    // schedule(&sim.eventq, 0, tick_event_from_id(src_id(0)));
-    // schedule(&sim.eventq, 0, tick_event_from_id(src_id(1)));
-    // schedule(&sim.eventq, 0, tick_event_from_id(src_id(2)));
-    // schedule(&sim.eventq, 0, tick_event_from_id(src_id(3)));
+    if (!sweep_rates.empty()) {
+        if (trace_path || cfg.evtrace_path || cfg.monitor_path ||
+            cfg.debug_mode ||
+            cfg.inj_type == INJ_MMPP) {
+            fprintf(stderr, "error: -sweep needs rate-driven synthetic "
+                            "traffic\n");
+            return 1;
+        }
+        std::vector<SweepPoint> points =
+            sweep_run(&cfg, sweep_rates, thread_count);
 
-    // VC vs. Wormhole (6-ary 2-torus)
-    // schedule(&sim.eventq, 0, tick_event_from_id(src_id(19)));
-    // schedule(&sim.eventq, 0, tick_event_from_id(src_id(20)));
+        FILE *f = sweep_out_path ? fopen(sweep_out_path, "w") : stdout;
+        if (!f) {
+            fatal("cannot open %s\n", sweep_out_path);
+        }
+        sweep_write_csv(f, points);
+        if (f != stdout) {
+            fclose(f);
+        }
+        return 0;
+    }
 
-    for (int i = 0; i < terminal_count; i++) {
-        schedule(&sim.eventq, 0, tick_event_from_id(src_id(i)));
+    TraceReader *trace = NULL;
+    if (trace_path) {
+        int terminal_count = 1;
+        for (int i = 0; i < cfg.r; i++) {
+            terminal_count *= cfg.k;
+        }
+        trace = trace_open(trace_path, terminal_count, trace_lookahead);
+        cfg.trace = trace;
+    }
+    if (trace_dump_path) {
+        cfg.trace_dump = trace_writer_open(trace_dump_path);
     }
 
-    sim_run(&sim, total_cycles);
+    Sim *sim = sim_create(&cfg);
+    // VC vs. Wormhole (6-ary 2-torus): only sources 19 and 20 inject.
+    // schedule(&sim->eventq, 0, tick_event_from_id(src_id(19)));
+    // schedule(&sim->eventq, 0, tick_event_from_id(src_id(20)));
 
-    sim_report(&sim);
+    sim_run(sim);
 
-    sim_destroy(&sim);
-    topology_destroy(&top);
+    sim_report(sim);
+
+    sim_destroy(sim);
+    if (cfg.trace_dump) {
+        trace_writer_close(cfg.trace_dump);
+    }
+    if (trace) {
+        trace_close(trace);
+    }
 
     return 0;
 }
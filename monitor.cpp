@@ -0,0 +1,144 @@
+#include "monitor.h"
+#include "sim.h"
+#include <string.h>
+
+static const char *stall_kind_str(int kind)
+{
+    static const char *names[STALL_KIND_COUNT] = {
+        "va_stall", "sa_stall", "credit_stall",
+    };
+    return names[kind];
+}
+
+Monitor *monitor_open(const char *path, MonitorFormat format, long interval,
+                      const Sim *sim)
+{
+    if (interval <= 0) {
+        fatal("monitor interval must be positive\n");
+    }
+    FILE *f = fopen(path, format == MON_BINARY ? "wb" : "w");
+    if (!f) {
+        fatal("cannot open monitor output %s\n", path);
+    }
+
+    const Router *r0 = sim->routers[0];
+    size_t router_count = sim->routers.size();
+    size_t vc_total = router_count * r0->radix * r0->vc_count;
+
+    Monitor *m = new Monitor;
+    m->file = f;
+    m->format = format;
+    m->interval = interval;
+    m->last_sample = 0;
+    m->next_sample = interval;
+    m->chan_flits.assign(sim->channels.size(), 0);
+    m->vc_area.assign(vc_total, 0);
+    m->stalls.assign(router_count * STALL_KIND_COUNT, 0);
+
+    if (format == MON_CSV) {
+        fprintf(f, "cycle,metric,node,port,vc,value\n");
+        return m;
+    }
+
+    MonitorHeader hdr;
+    memcpy(hdr.magic, MONITOR_MAGIC, sizeof(hdr.magic));
+    hdr.version = MONITOR_VERSION;
+    hdr.channel_count = sim->channels.size();
+    hdr.router_count = router_count;
+    hdr.radix = r0->radix;
+    hdr.vc_count = r0->vc_count;
+    hdr.stall_kind_count = STALL_KIND_COUNT;
+    hdr.interval = interval;
+    std::vector<MonitorChannel> descs;
+    for (const Channel &ch : sim->channels) {
+        MonitorChannel d;
+        d.src_type = ch.conn.src.id.type;
+        d.src_id = ch.conn.src.id.value;
+        d.src_port = ch.conn.src.port;
+        d.dst_type = ch.conn.dst.id.type;
+        d.dst_id = ch.conn.dst.id.value;
+        d.dst_port = ch.conn.dst.port;
+        descs.push_back(d);
+    }
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+        fwrite(descs.data(), sizeof(MonitorChannel), descs.size(), f) !=
+            descs.size()) {
+        fatal("cannot write monitor output %s\n", path);
+    }
+    m->frame.reserve(descs.size() + vc_total + m->stalls.size());
+    return m;
+}
+
+// Append a value to the sample being written.
+static void monitor_put(Monitor *m, long now, const char *metric, Id id,
+                        int port, int vc, double value)
+{
+    if (m->format == MON_BINARY) {
+        m->frame.push_back(value);
+    } else {
+        char s[IDSTRLEN];
+        fprintf(m->file, "%ld,%s,%s,%d,%d,%g\n", now, metric, id_str(id, s),
+                port, vc, value);
+    }
+}
+
+// Write the values of the window (last_sample, now] and start a new window.
+void monitor_sample(Monitor *m, const Sim *sim, long now)
+{
+    long window = now - m->last_sample;
+    if (window <= 0) {
+        return;
+    }
+    m->frame.clear();
+
+    for (size_t i = 0; i < sim->channels.size(); i++) {
+        const Channel &ch = sim->channels[i];
+        long flits = ch.load_count - m->chan_flits[i];
+        m->chan_flits[i] = ch.load_count;
+        monitor_put(m, now, "chan_util", ch.conn.src.id, ch.conn.src.port, -1,
+                    static_cast<double>(flits) / (window * ch.width));
+    }
+
+    size_t v = 0;
+    for (const Router *r : sim->routers) {
+        for (int port = 0; port < r->radix; port++) {
+            for (int vc = 0; vc < r->vc_count; vc++, v++) {
+                const InputVCs &iv = r->ivcs;
+                int ivc = vc_index(r, port, vc);
+                // Account up to now without touching the router.
+                long area = iv.occ_area[ivc] +
+                            ivc_len(iv, ivc) * (now - iv.occ_time[ivc]);
+                monitor_put(m, now, "vc_occ", r->id, port, vc,
+                            static_cast<double>(area - m->vc_area[v]) /
+                                window);
+                m->vc_area[v] = area;
+            }
+        }
+    }
+
+    size_t s = 0;
+    for (const Router *r : sim->routers) {
+        for (int kind = 0; kind < STALL_KIND_COUNT; kind++, s++) {
+            monitor_put(m, now, stall_kind_str(kind), r->id, -1, -1,
+                        r->stall_count[kind] - m->stalls[s]);
+            m->stalls[s] = r->stall_count[kind];
+        }
+    }
+
+    if (m->format == MON_BINARY) {
+        int64_t t = now;
+        if (fwrite(&t, sizeof(t), 1, m->file) != 1 ||
+            fwrite(m->frame.data(), sizeof(float), m->frame.size(),
+                   m->file) != m->frame.size()) {
+            fatal("cannot write monitor output\n");
+        }
+    }
+    m->last_sample = now;
+    m->next_sample = now + m->interval;
+}
+
+void monitor_close(Monitor *m)
+{
+    fclose(m->file);
+    delete m;
+}
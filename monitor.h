@@ -0,0 +1,72 @@
+#ifndef MONITOR_H
+#define MONITOR_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+struct Sim;
+
+// Windowed utilization time series of channels, router input VCs and router
+// allocators, for finding hotspot links and saturated routers.
+//
+// Every 'interval' cycles the monitor takes the difference of the running
+// counters since the last sample and writes one row per channel, per router
+// input VC and per router, as:
+//
+//   - channel utilization: flits put / (interval * link width)
+//   - VC occupancy: time-averaged input buffer length in flits
+//   - stalls: lost VA and SA requests and credit waits, per router
+//
+// The CSV format has one line per value.  The binary format is a
+// MonitorHeader, 'channel_count' MonitorChannels describing the channels,
+// then for each sample an int64 cycle followed by the float values in the
+// order above, all in native byte order.
+
+#define MONITOR_MAGIC "NSIMMON1"
+#define MONITOR_VERSION 1
+
+enum MonitorFormat {
+    MON_CSV,
+    MON_BINARY,
+};
+
+struct MonitorHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t channel_count;
+    uint32_t router_count;
+    uint32_t radix;
+    uint32_t vc_count;
+    uint32_t stall_kind_count;
+    int64_t interval;
+};
+
+struct MonitorChannel {
+    int32_t src_type; // IdType
+    int32_t src_id;
+    int32_t src_port;
+    int32_t dst_type;
+    int32_t dst_id;
+    int32_t dst_port;
+};
+
+struct Monitor {
+    FILE *file;
+    MonitorFormat format;
+    long interval;
+    long last_sample; // cycle of the last sample
+    long next_sample; // cycle of the next sample
+    // Running counters as of the last sample, as flat arrays.
+    std::vector<long> chan_flits; // [channel]
+    std::vector<long> vc_area;    // [router][port][vc]
+    std::vector<long> stalls;     // [router][StallKind]
+    std::vector<float> frame;     // values of one binary sample
+};
+
+Monitor *monitor_open(const char *path, MonitorFormat format, long interval,
+                      const Sim *sim);
+void monitor_sample(Monitor *m, const Sim *sim, long now);
+void monitor_close(Monitor *m);
+
+#endif
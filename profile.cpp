@@ -0,0 +1,37 @@
+#include "profile.h"
+#include <stdio.h>
+
+const char *prof_stage_str(int stage)
+{
+    static const char *names[PROF_STAGE_COUNT] = {
+        "source_generate",     "destination_consume", "switch_traverse",
+        "switch_alloc",        "vc_alloc",            "route_compute",
+        "credit_update",       "fetch_credit",        "fetch_flit",
+        "update_states",
+    };
+    return (0 <= stage && stage < PROF_STAGE_COUNT) ? names[stage] : "??";
+}
+
+void profile_print(const Profile *p)
+{
+    double secs = p->run_ns / 1e9;
+    uint64_t stage_total = 0;
+    for (int i = 0; i < PROF_STAGE_COUNT; i++) {
+        stage_total += p->stage_ns[i];
+    }
+
+    printf("Profile: %.3f s wall, %ld cycles (%.0f cycles/s)\n", secs,
+           p->run_cycles, secs > 0.0 ? p->run_cycles / secs : 0.0);
+    printf("  events: %ld (%.0f events/s), peak event queue: %zu\n",
+           p->event_count, secs > 0.0 ? p->event_count / secs : 0.0,
+           p->peak_queue);
+    printf("  ticks: %ld, double ticks: %ld (%.1f%%)\n", p->tick_count,
+           p->double_tick_count,
+           p->tick_count ? 100.0 * p->double_tick_count / p->tick_count
+                         : 0.0);
+    for (int i = 0; i < PROF_STAGE_COUNT; i++) {
+        printf("  %-20s %9.3f ms %5.1f%%\n", prof_stage_str(i),
+               p->stage_ns[i] / 1e6,
+               stage_total ? 100.0 * p->stage_ns[i] / stage_total : 0.0);
+    }
+}
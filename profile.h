@@ -0,0 +1,58 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+// Self-profiling counters of the simulator itself, as opposed to the
+// statistics of the simulated network in Stat.  Off by default; when off the
+// hot path pays one predictable branch per stage.
+
+enum ProfStage {
+    PROF_GENERATE,     // source_generate
+    PROF_CONSUME,      // destination_consume
+    PROF_ST,           // switch_traverse
+    PROF_SA,           // switch_alloc
+    PROF_VA,           // vc_alloc
+    PROF_RC,           // route_compute
+    PROF_CREDIT,       // credit_update
+    PROF_FETCH_CREDIT, // fetch_credit
+    PROF_FETCH_FLIT,   // fetch_flit
+    PROF_UPDATE,       // update_states and rescheduling
+    PROF_STAGE_COUNT,
+};
+
+struct Profile {
+    bool enabled = false;
+    long event_count = 0;       // events popped off the event queue
+    long tick_count = 0;        // router ticks, including double ticks
+    long double_tick_count = 0; // ticks dropped as already done this cycle
+    size_t peak_queue = 0;      // max # of pending events
+    uint64_t run_ns = 0;        // wall time spent in the event loop
+    long run_cycles = 0;        // simulated cycles in 'run_ns'
+    uint64_t stage_ns[PROF_STAGE_COUNT] = {};
+};
+
+static inline uint64_t prof_clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Charge the time since '*t' to 'stage' and restart '*t'.  No-op if 'p' is
+// NULL.
+static inline void prof_lap(Profile *p, ProfStage stage, uint64_t *t)
+{
+    if (p) {
+        uint64_t now = prof_clock();
+        p->stage_ns[stage] += now - *t;
+        *t = now;
+    }
+}
+
+const char *prof_stage_str(int stage);
+void profile_print(const Profile *p);
+
+#endif
@@ -2,41 +2,114 @@
 #define QUEUE_H
 
 #include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <type_traits>
 
-void *queue_initf(void *a, size_t elemsize, size_t len);
-#ifdef __cplusplus
-template <class T> static T *queue_init_wrapper(T *a, size_t elemsize, size_t len) {
-  return (T*)queue_initf(a, elemsize, len);
+// Typed ring buffer whose capacity is a power of two, so that indices wrap
+// with a mask instead of a division.  'front' and 'back' run freely and are
+// only masked on access, which makes the length a subtraction and the
+// full/empty checks a single compare, with no slot wasted.
+//
+// A fixed ring must be checked with ring_full() before ring_put().  A
+// growable ring doubles its capacity instead of filling up.  A
+// zero-initialized Ring is a valid empty ring of no capacity.
+template <class T> struct Ring {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "ring elements are moved with memcpy");
+    T *buf = NULL;
+    size_t mask = 0;  // capacity - 1
+    size_t front = 0; // index of the front element, unmasked
+    size_t back = 0;  // index past the back element, unmasked
+    bool growable = false;
+};
+
+// Initialize 'q' to hold at least 'min_cap' elements.
+template <class T>
+static inline void ring_init(Ring<T> *q, size_t min_cap, bool growable)
+{
+    size_t cap = 1;
+    while (cap < min_cap) {
+        cap <<= 1;
+    }
+    q->buf = static_cast<T *>(malloc(cap * sizeof(T)));
+    assert(q->buf);
+    q->mask = cap - 1;
+    q->front = q->back = 0;
+    q->growable = growable;
+}
+
+template <class T> static inline void ring_free(Ring<T> *q)
+{
+    free(q->buf);
+    *q = Ring<T>();
+}
+
+template <class T> static inline size_t ring_cap(const Ring<T> *q)
+{
+    return q->buf ? q->mask + 1 : 0;
 }
-#else
-#define queue_init_wrapper queue_initf
-#endif
 
-#define queue_init(a, n) ((a) = queue_init_wrapper((a), sizeof(*(a)), (n)))
-#define queue_full(a) (queue_len((a)) == (long)queue_header(a)->cap - 1)
-#define queue_empty(a) (queue_header(a)->front == queue_header(a)->back)
-#define queue_put(a, elem)                                                     \
-  (queue_full(a) ? NULL                                                        \
-                 : (a[queue_header(a)->back] = (elem),                         \
-                    queue_header(a)->back =                                    \
-                        (queue_header(a)->back + 1) % queue_header(a)->cap,    \
-                    (a)))
-#define queue_front(a) (a[queue_header(a)->front])
-#define queue_fronti(a) (queue_header(a)->front)
-#define queue_backi(a) (queue_header(a)->back)
-#define queue_cap(a) (queue_header(a)->cap)
-#define queue_pop queue_popf
-
-#define queue_header(t) ((Queue *)(t) - 1)
-
-typedef struct Queue {
-  size_t cap;
-  long front;
-  long back;
-} Queue;
-
-void queue_free(void *a);
-long queue_len(const void *a);
-void queue_popf(void *a);
+template <class T> static inline size_t ring_len(const Ring<T> *q)
+{
+    return q->back - q->front;
+}
+
+template <class T> static inline bool ring_empty(const Ring<T> *q)
+{
+    return q->back == q->front;
+}
+
+template <class T> static inline bool ring_full(const Ring<T> *q)
+{
+    return ring_len(q) == ring_cap(q);
+}
+
+// The i-th element from the front.
+template <class T> static inline T &ring_at(const Ring<T> *q, size_t i)
+{
+    assert(i < ring_len(q));
+    return q->buf[(q->front + i) & q->mask];
+}
+
+template <class T> static inline T &ring_front(const Ring<T> *q)
+{
+    return ring_at(q, 0);
+}
+
+// Double the capacity of a full growable ring, unwrapping its elements.
+template <class T> static void ring_grow(Ring<T> *q)
+{
+    assert(q->growable);
+    size_t len = ring_len(q);
+    size_t cap = q->buf ? 2 * (q->mask + 1) : 1;
+    T *buf = static_cast<T *>(malloc(cap * sizeof(T)));
+    assert(buf);
+    size_t head = q->front & q->mask;
+    size_t first = len < ring_cap(q) - head ? len : ring_cap(q) - head;
+    if (len) {
+        memcpy(buf, q->buf + head, first * sizeof(T));
+        memcpy(buf + first, q->buf, (len - first) * sizeof(T));
+    }
+    free(q->buf);
+    q->buf = buf;
+    q->mask = cap - 1;
+    q->front = 0;
+    q->back = len;
+}
+
+template <class T> static inline void ring_put(Ring<T> *q, const T &elem)
+{
+    if (ring_full(q)) {
+        ring_grow(q);
+    }
+    q->buf[q->back++ & q->mask] = elem;
+}
+
+template <class T> static inline T ring_pop(Ring<T> *q)
+{
+    assert(!ring_empty(q));
+    return q->buf[q->front++ & q->mask];
+}
 
 #endif
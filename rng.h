@@ -0,0 +1,78 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+// Philox4x32-10 counter-based random number generator (Salmon et al., SC'11).
+//
+// Each output block is a pure function of (key, counter), so that a stream is
+// fully determined by the seed (the key) and its stream number (the upper
+// half of the counter).  Streams never share state, and drawing from one
+// stream does not perturb another.  Satisfies UniformRandomBitGenerator, so
+// it can drive the <random> distributions.
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+
+static inline void philox_block(const uint32_t key_in[2],
+                                const uint32_t ctr_in[4], uint32_t out[4])
+{
+    uint32_t k0 = key_in[0], k1 = key_in[1];
+    uint32_t c0 = ctr_in[0], c1 = ctr_in[1], c2 = ctr_in[2], c3 = ctr_in[3];
+    for (int i = 0; i < PHILOX_ROUNDS; i++) {
+        uint64_t p0 = static_cast<uint64_t>(PHILOX_M0) * c0;
+        uint64_t p1 = static_cast<uint64_t>(PHILOX_M1) * c2;
+        uint32_t hi0 = p0 >> 32, lo0 = static_cast<uint32_t>(p0);
+        uint32_t hi1 = p1 >> 32, lo1 = static_cast<uint32_t>(p1);
+        c0 = hi1 ^ c1 ^ k0;
+        c1 = lo1;
+        c2 = hi0 ^ c3 ^ k1;
+        c3 = lo0;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+}
+
+struct Philox {
+    typedef uint32_t result_type;
+
+    Philox(uint64_t seed = 0, uint64_t stream = 0)
+    {
+        key[0] = static_cast<uint32_t>(seed);
+        key[1] = static_cast<uint32_t>(seed >> 32);
+        ctr[0] = ctr[1] = 0;
+        ctr[2] = static_cast<uint32_t>(stream);
+        ctr[3] = static_cast<uint32_t>(stream >> 32);
+        pos = 4;
+    }
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return UINT32_MAX; }
+
+    result_type operator()()
+    {
+        if (pos == 4) {
+            philox_block(key, ctr, buf);
+            // 64-bit block counter in the lower half of the counter.
+            if (++ctr[0] == 0) {
+                ctr[1]++;
+            }
+            pos = 0;
+        }
+        return buf[pos++];
+    }
+
+    uint32_t key[2];
+    uint32_t ctr[4]; // {block lo, block hi, stream lo, stream hi}
+    uint32_t buf[4]; // current output block
+    int pos;         // next word in 'buf'
+};
+
+#endif
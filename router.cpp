@@ -7,38 +7,24 @@
 #include <assert.h>
 #include <random>
 #include <climits>
+#include <algorithm>
 
-TrafficDesc::TrafficDesc(int terminal_count)
-    : type(TRF_UNIFORM_RANDOM), dests(terminal_count)
-{
-}
-
-RandomGenerator::RandomGenerator(int terminal_count, double mean_interval)
-    : def(), rd(), uni_dist(0, terminal_count - 1),
+RandomGenerator::RandomGenerator(uint64_t seed, int terminal_count,
+                                 double mean_interval)
+    : rng(seed), uni_dist(0, terminal_count - 1),
+      uni_dist_others(0, std::max(terminal_count - 2, 0)), unit_dist(0.0, 1.0),
       exp_dist(1.0 / mean_interval)
 {
-    // TODO: seed?
-}
-
-template <typename T> T &Router::get_device() const
-{
-    if (deterministic) {
-        return rand_gen.def;
-    } else {
-        return rand_gen.rd;
-    }
 }
 
-void debugf(Router *r, const char *fmt, ...)
+void debugf_impl(Router *r, const char *fmt, ...)
 {
-    if (r->verbose) {
-        char s[IDSTRLEN];
-        printf("[@%3ld] [%s] ", curr_time(r->eventq), id_str(r->id, s));
-        va_list args;
-        va_start(args, fmt);
-        vprintf(fmt, args);
-        va_end(args);
-    }
+    char s[IDSTRLEN];
+    printf("[@%3ld] [%s] ", curr_time(r->eventq), id_str(r->id, s));
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
 }
 
 void warnf(Router *r, const char *fmt, ...)
@@ -56,51 +42,104 @@ Event tick_event_from_id(Id id)
     return (Event){id, router_tick};
 }
 
-Channel::Channel(EventQueue *eq, long dl, const Connection conn)
-    : conn(conn), eventq(eq), delay(dl), buf_credit()
+// Record a pipeline event of flit 'flitnum' of packet 'pid' at cycle 'time'
+// into the event trace, if enabled.  'flitnum' is -1 for credits.
+static inline void trace_event_pkt(Router *r, long time, EvKind kind,
+                                   PacketId pid, long flitnum, int port,
+                                   long vc)
+{
+    EvTrace *t = r->sim.evtrace;
+    if (!t) {
+        return;
+    }
+    EvRecord rec{};
+    rec.time = time;
+    rec.packet_id = pid.id;
+    rec.packet_src = pid.src;
+    rec.node = r->id.value;
+    rec.flitnum = flitnum;
+    rec.node_type = r->id.type;
+    rec.kind = kind;
+    rec.port = port;
+    rec.vc = vc;
+    evtrace_put(t, rec);
+}
+
+// Record a pipeline event into the event trace, if enabled.  'flit' is NULL
+// for credits.
+static inline void trace_event(Router *r, EvKind kind, const Flit *flit,
+                               int port, long vc)
+{
+    long now = r->eventq->curr_time();
+    if (flit) {
+        trace_event_pkt(r, now, kind, flit->packet_id, flit->flitnum, port,
+                        vc);
+    } else {
+        trace_event_pkt(r, now, kind, PacketId{-1, -1}, -1, port, vc);
+    }
+}
+
+Channel::Channel(EventQueue *eq, const Connection conn)
+    : conn(conn), eventq(eq), delay(conn.link.delay), width(conn.link.width)
 {
-    queue_init(buf, dl + CHANNEL_SLACK);
+    assert(delay >= 1 && width >= 1);
+    // At most 'width' flits are put in each cycle, and a flit stays in the
+    // channel for 'delay' cycles plus the cycle it is fetched in.
+    ring_init(&buf, (delay + 1) * width + CHANNEL_SLACK, false);
+    ring_init(&buf_credit, delay + 1, true);
 }
 
 Channel::~Channel()
 {
-    while (!queue_empty(buf)) {
-        TimedFlit front = queue_front(buf);
-        delete front.flit;
-        queue_pop(buf);
+    while (!ring_empty(&buf)) {
+        delete ring_pop(&buf).flit;
     }
-    while (!buf_credit.empty()) {
-        TimedCredit front = buf_credit.front();
-        delete front.credit;
-        buf_credit.pop_front();
+    while (!ring_empty(&buf_credit)) {
+        delete ring_pop(&buf_credit).credit;
     }
-    queue_free(buf);
+    ring_free(&buf);
+    ring_free(&buf_credit);
 }
 
 void channel_put(Channel *ch, Flit *flit)
 {
     TimedFlit tf = {curr_time(ch->eventq) + ch->delay, flit};
-    assert(!queue_full(ch->buf));
-    queue_put(ch->buf, tf);
-    reschedule(ch->eventq, ch->delay, tick_event_from_id(ch->conn.dst.id));
-    ch->load_count += queue_len(ch->buf);
+    if (ch->last_put_time != curr_time(ch->eventq)) {
+        ch->last_put_time = curr_time(ch->eventq);
+        ch->put_count = 0;
+    }
+    assert(ch->put_count < ch->width && "Channel bandwidth exceeded!");
+    ch->put_count++;
+    assert(!ring_full(&ch->buf));
+    ring_put(&ch->buf, tf);
+    if (ch->dst_node) {
+        bitmap_set(ch->dst_node->flit_pending, ch->conn.dst.port);
+        router_wake(ch->dst_node, tf.time);
+    } else {
+        schedule(ch->eventq, tf.time, tick_event_from_id(ch->conn.dst.id));
+    }
+    ch->load_count++;
 }
 
 void channel_put_credit(Channel *ch, Credit *credit)
 {
     TimedCredit tc = {curr_time(ch->eventq) + ch->delay, credit};
-    ch->buf_credit.push_back(tc);
-    reschedule(ch->eventq, ch->delay, tick_event_from_id(ch->conn.src.id));
+    ring_put(&ch->buf_credit, tc);
+    if (ch->src_node) {
+        bitmap_set(ch->src_node->credit_pending, ch->conn.src.port);
+        router_wake(ch->src_node, tc.time);
+    } else {
+        schedule(ch->eventq, tc.time, tick_event_from_id(ch->conn.src.id));
+    }
 }
 
 Flit *channel_get(Channel *ch)
 {
-    TimedFlit front = queue_front(ch->buf);
-    if (!queue_empty(ch->buf) && curr_time(ch->eventq) >= front.time) {
-        assert(curr_time(ch->eventq) == front.time && "stale flit!");
-        Flit *flit = front.flit;
-        queue_pop(ch->buf);
-        return flit;
+    if (!ring_empty(&ch->buf) &&
+        curr_time(ch->eventq) >= ring_front(&ch->buf).time) {
+        assert(curr_time(ch->eventq) == ring_front(&ch->buf).time &&
+               "stale flit!");
+        return ring_pop(&ch->buf).flit;
     } else {
         return NULL;
     }
@@ -108,12 +147,14 @@ Flit *channel_get(Channel *ch)
 
 Credit *channel_get_credit(Channel *ch)
 {
-    TimedCredit front = ch->buf_credit.front();
-    if (!ch->buf_credit.empty() && curr_time(ch->eventq) >= front.time) {
+    if (ring_empty(&ch->buf_credit)) {
+        return NULL;
+    }
+    TimedCredit front = ring_front(&ch->buf_credit);
+    if (curr_time(ch->eventq) >= front.time) {
         assert(curr_time(ch->eventq) == front.time && "stale flit!");
-        Credit *credit = front.credit;
-        ch->buf_credit.pop_front();
-        return credit;
+        ring_pop(&ch->buf_credit);
+        return front.credit;
     } else {
         return NULL;
     }
@@ -191,132 +232,214 @@ char *globalstate_str(enum GlobalState state, char *s)
     return s;
 }
 
-InputUnit::InputUnit(int vc_count, int bufsize)
+void input_vcs_init(InputVCs *iv, Arena *a, int count, long buf_cap)
 {
-    vcs.reserve(vc_count);
-    for (int i = 0; i < vc_count; i++) {
-        vcs.emplace_back(bufsize);
+    iv->count = count;
+    iv->buf_cap = buf_cap;
+    iv->buf_shift = 0;
+    while ((1l << iv->buf_shift) < buf_cap) {
+        iv->buf_shift++;
     }
+    iv->global = arena_array(a, count, STATE_IDLE);
+    iv->next_global = arena_array(a, count, STATE_IDLE);
+    iv->stage = arena_array(a, count, PIPELINE_IDLE);
+    iv->route_port = arena_array(a, count, -1);
+    iv->output_vc = arena_array(a, count, -1);
+    iv->buf_front = arena_array(a, count, 0l);
+    iv->buf_len = arena_array(a, count, 0l);
+    iv->slab = arena_array<Flit *>(a, count << iv->buf_shift, NULL);
+    iv->st_ready = arena_array<Flit *>(a, count, NULL);
+    iv->occ_area = arena_array(a, count, 0l);
+    iv->occ_time = arena_array(a, count, 0l);
+    iv->words = bitmap_words(count);
+    iv->routing_set = arena_array<uint64_t>(a, iv->words, 0);
+    iv->vcwait_set = arena_array<uint64_t>(a, iv->words, 0);
+    iv->active_set = arena_array<uint64_t>(a, iv->words, 0);
+    iv->st_ready_set = arena_array<uint64_t>(a, iv->words, 0);
+    iv->changed_set = arena_array<uint64_t>(a, iv->words, 0);
 }
 
-InputUnit::VC::VC(int bufsize)
+void output_vcs_init(OutputVCs *ov, Arena *a, int count, int credit_count)
 {
-    buf = NULL;
-    queue_init(buf, bufsize * 2);
-}
-
-InputUnit::VC::~VC()
-{
-    while (!queue_empty(buf)) {
-        Flit *flit = queue_front(buf);
-        delete flit;
-        queue_pop(buf);
-    }
-    queue_free(buf);
-    if (st_ready) {
-        delete st_ready;
-    }
+    ov->count = count;
+    ov->global = arena_array(a, count, STATE_IDLE);
+    ov->next_global = arena_array(a, count, STATE_IDLE);
+    ov->input_port = arena_array(a, count, -1);
+    ov->input_vc = arena_array(a, count, -1);
+    ov->credit_count = arena_array(a, count, credit_count);
+    ov->words = bitmap_words(count);
+    ov->credit_set = arena_array<uint64_t>(a, ov->words, 0);
+    ov->changed_set = arena_array<uint64_t>(a, ov->words, 0);
 }
 
-OutputUnit::OutputUnit(int vc_count, int bufsize)
+// Allocate the arrays of 'r' from 'a', or only count their size if 'r' is
+// NULL.
+static void router_arrays_alloc(Router *r, Arena *a, int radix, int vc_count,
+                                long input_buf_size)
 {
-    vcs.reserve(vc_count);
-    for (int i = 0; i < vc_count; i++) {
-        vcs.emplace_back(bufsize);
+    int n = radix * vc_count;
+    InputVCs iv;
+    OutputVCs ov;
+    Channel **in = arena_array<Channel *>(a, radix, NULL);
+    Channel **out = arena_array<Channel *>(a, radix, NULL);
+    int port_words = bitmap_words(radix);
+    uint64_t *flit_pending = arena_array<uint64_t>(a, port_words, 0);
+    uint64_t *credit_pending = arena_array<uint64_t>(a, port_words, 0);
+    input_vcs_init(&iv, a, n, input_buf_size);
+    output_vcs_init(&ov, a, n, input_buf_size);
+    int *va_input = arena_array(a, n, 0);
+    int *va_output = arena_array(a, n, 0);
+    int *sa_input = arena_array(a, n, 0);
+    int *sa_output = arena_array(a, radix, 0);
+    Router::Allocator alloc;
+    alloc.va_input_winner = arena_array(a, n, -1);
+    alloc.va_output_best = arena_array(a, n, -1);
+    alloc.va_requested = arena_array<uint64_t>(a, iv.words, 0);
+    alloc.grant_set = arena_array<uint64_t>(a, iv.words, 0);
+    alloc.sa_requests = arena_array<uint64_t>(a, radix * iv.words, 0);
+    alloc.sa_requested = arena_array<uint64_t>(a, port_words, 0);
+    if (r) {
+        r->input_channels = in;
+        r->output_channels = out;
+        r->port_words = port_words;
+        r->flit_pending = flit_pending;
+        r->credit_pending = credit_pending;
+        r->ivcs = iv;
+        r->ovcs = ov;
+        r->va_last_grant_input = va_input;
+        r->va_last_grant_output = va_output;
+        r->sa_last_grant_input = sa_input;
+        r->sa_last_grant_output = sa_output;
+        r->alloc = alloc;
     }
 }
 
-OutputUnit::VC::VC(int bufsize) : credit_count(bufsize)
+// Bytes of arena taken by a router and its arrays, rounded up so that the
+// next router starts at a cache line.
+size_t router_arena_size(int radix, int vc_count, long input_buf_size)
 {
-    // buf_credit = NULL;
-    // queue_init(buf_credit, bufsize * 2); // FIXME: unnecessarily big.
+    Arena a;
+    arena_alloc(&a, sizeof(Router), ARENA_ALIGN);
+    router_arrays_alloc(NULL, &a, radix, vc_count, input_buf_size);
+    return (a.used + ARENA_ALIGN - 1) & ~static_cast<size_t>(ARENA_ALIGN - 1);
 }
 
-OutputUnit::VC::~VC()
-{
-    // queue_free(buf_credit);
-}
-
-Router::Router(Sim &sim, EventQueue *eq, Stat *st, bool verbose, Id id,
-               int radix, int vc_count, TopoDesc td, TrafficDesc trd,
-               RandomGenerator &rg, long packet_len, Channel **in_chs,
-               Channel **out_chs, long input_buf_size)
+Router::Router(Sim &sim, Arena *arena, EventQueue *eq, Stat *st, bool verbose,
+               Id id, int radix, int vc_count, TopoDesc td,
+               const TrafficDesc &trd, const RandomGenerator &rg,
+               Channel *const *in_chs, Channel *const *out_chs,
+               long input_buf_size)
     : sim(sim), eventq(eq), stat(st), verbose(verbose), id(id), radix(radix),
       vc_count(vc_count), top_desc(td), traffic_desc(trd), rand_gen(rg),
-      packet_len(packet_len), input_buf_size(input_buf_size),
-      src_last_grant_output(0), dst_last_grant_input(0),
-      va_last_grant_input(radix * vc_count, 0),
-      va_last_grant_output(radix * vc_count, 0),
-      sa_last_grant_input(radix * vc_count, 0), sa_last_grant_output(radix, 0)
+      input_buf_size(input_buf_size), src_last_grant_output{0},
+      dst_last_grant_input(0)
 {
-    // Can only segregate VCs into classes if we do have multiple VCs.
-    vc_class_count = (vc_count > 1) ? 2 : 1;
-
-    // Copy channel list
-    input_channels = NULL;
-    output_channels = NULL;
-    for (long i = 0; i < arrlen(in_chs); i++)
-        arrput(input_channels, in_chs[i]);
-    for (long i = 0; i < arrlen(out_chs); i++)
-        arrput(output_channels, out_chs[i]);
-
-    // Source queues are supposed to be infinite in size, but since our
-    // queue implementation does not support dynamic extension, let's just
-    // assume a fixed, arbitrary massive size for its queue. Nonurgent TODO.
-    source_queue = NULL;
-    if (is_src(id)) {
-        queue_init(source_queue, 10000);
+    // Same distributions as 'rg', on the stream of this node.
+    rand_gen.rng = Philox(sim.seed, rng_stream(id));
+
+    router_arrays_alloc(this, arena, radix, vc_count, input_buf_size);
+
+    router_set_msg_classes(this, 1);
+
+    // Copy channel list, and attach to the channels to be woken up on
+    // arrivals.
+    for (int i = 0; i < radix; i++) {
+        input_channels[i] = in_chs ? in_chs[i] : NULL;
+        output_channels[i] = out_chs ? out_chs[i] : NULL;
+        if (input_channels[i]) {
+            input_channels[i]->dst_node = this;
+        }
+        if (output_channels[i]) {
+            output_channels[i]->src_node = this;
+        }
     }
 
-    input_units.reserve(radix);
-    output_units.reserve(radix);
-    for (int port = 0; port < radix; port++) {
-        input_units.emplace_back(vc_count, input_buf_size);
-        output_units.emplace_back(vc_count, input_buf_size);
+    // Source queues are infinite in size.
+    if (is_src(id)) {
+        ring_init(&source_queue, SOURCE_QUEUE_INIT_CAP, true);
     }
 
     if (is_src(id) || is_dst(id)) {
-        assert(input_units.size() == 1);
-        assert(output_units.size() == 1);
+        assert(radix == 1);
         // There are no route computation stages for terminal nodes, so set the
         // routed ports and allocated VCs for each IU/OU statically here.
         for (int i = 0; i < vc_count; i++) {
-            input_units[0].vcs[i].route_port = TERMINAL_PORT;
-            input_units[0].vcs[i].output_vc = 0; // unnecessary?
-            output_units[0].vcs[i].input_port = TERMINAL_PORT;
-            output_units[0].vcs[i].input_vc = 0; // unnnecessary
+            ivcs.route_port[i] = TERMINAL_PORT;
+            ivcs.output_vc[i] = 0; // unnecessary?
+            ovcs.input_port[i] = TERMINAL_PORT;
+            ovcs.input_vc[i] = 0; // unnnecessary
         }
     }
 }
 
 Router::~Router()
 {
-    if (source_queue) {
-        while (!queue_empty(source_queue)) {
-            Flit *flit = queue_front(source_queue);
-            delete flit;
-            queue_pop(source_queue);
+    ring_free(&source_queue);
+    ring_free(&reply_queue);
+    // The arrays themselves go away with the arena, but not the flits.
+    for (int ivc = 0; ivc < ivcs.count; ivc++) {
+        while (!ivc_empty(ivcs, ivc)) {
+            delete ivc_pop(ivcs, ivc);
         }
-        queue_free(source_queue);
+        delete ivcs.st_ready[ivc];
+    }
+}
+
+// Split the VCs into 'msg_class_count' disjoint sets, one for each message
+// class.  Within each set, VCs are further split into classes for dateline
+// deadlock avoidance.
+void router_set_msg_classes(Router *r, int msg_class_count)
+{
+    assert(msg_class_count >= 1 && msg_class_count <= MSG_CLASS_COUNT);
+    assert(r->vc_count % msg_class_count == 0);
+    r->msg_class_count = msg_class_count;
+    // Can only segregate VCs into classes if we do have multiple VCs.
+    r->vc_class_count = (r->vc_count / msg_class_count > 1) ? 2 : 1;
+
+    if (is_src(r->id) && msg_class_count > 1 && !r->reply_queue.buf) {
+        ring_init(&r->reply_queue, SOURCE_QUEUE_INIT_CAP, true);
+    }
+}
+
+// Schedule a tick of 'r' at cycle 'when', unless the last tick scheduled is
+// already at that cycle.  Either that tick is still pending, or it is a tick
+// of this cycle that has run, and another one would be a double tick.
+void router_wake(Router *r, long when)
+{
+    assert(when >= curr_time(r->eventq));
+    if (when != r->wake_time) {
+        schedule(r->eventq, when, tick_event_from_id(r->id));
+        r->wake_time = when;
     }
-    arrfree(input_channels);
-    arrfree(output_channels);
 }
 
 void router_reschedule(Router *r)
 {
-    if (r->reschedule_next_tick) {
-        reschedule(r->eventq, 1, tick_event_from_id(r->id));
+    if (r->reschedule_next_tick || r->sim.lockstep) {
+        router_wake(r, curr_time(r->eventq) + 1);
     }
 }
 
+// Whether the clockwise and counterclockwise ways from src_id to dst_id along
+// 'direction' are equally short, and the route has to pick one by chance.
+static bool source_route_tied(TopoDesc td, int src_id, int dst_id,
+                              int direction)
+{
+    int total = td.k;
+    int src_id_xyz = torus_id_xyz_get(src_id, td.k, direction);
+    int dst_id_xyz = torus_id_xyz_get(dst_id, td.k, direction);
+    int cw_dist = (dst_id_xyz - src_id_xyz + total) % total;
+    return (total % 2) == 0 && cw_dist == (total / 2);
+}
+
 // Compute route on a ring that is laid along a single dimension.
-// Expects that src_id and dst_id is on the same ring.
+// Expects that src_id and dst_id is on the same ring.  'to_larger' picks the
+// way if both are equally short.
 // Appends computed route after 'path'. Does NOT put the final routing to the
 // terminal node.
-static void source_route_compute_dimension(Router *r, TopoDesc td,
-                                           int src_id, int dst_id,
-                                           int direction,
+static void source_route_compute_dimension(TopoDesc td, int src_id,
+                                           int dst_id, int direction,
+                                           int to_larger,
                                            std::vector<int> &path)
 {
     int total = td.k;
@@ -324,14 +447,11 @@ static void source_route_compute_dimension(Router *r, TopoDesc td,
     int dst_id_xyz = torus_id_xyz_get(dst_id, td.k, direction);
     int cw_dist = (dst_id_xyz - src_id_xyz + total) % total;
 
-    if ((total % 2) == 0 && cw_dist == (total / 2)) {
-        int dice = r->rand_gen.uni_dist(r->rand_gen.rd);
-        int to_larger = (dice % 2 == 0) ? 1 : 0;
-
+    if (source_route_tied(td, src_id, dst_id, direction)) {
         // Adaptive routing
 
         // int first_hop_id = r->output_channels[TERMINAL_PORT]->conn.dst.id.value;
-        // Router *first_hop = r->sim.routers[first_hop_id].get();
+        // Router *first_hop = r->sim.routers[first_hop_id];
         // int credit_for_larger =
         //     first_hop->output_units[get_output_port(direction, 1)].credit_count;
         // int credit_for_smaller =
@@ -359,16 +479,36 @@ static void source_route_compute_dimension(Router *r, TopoDesc td,
         }
     } else {
         // Counterclockwise
-        // TODO: if CW == CCW, pick random
         for (int i = 0; i < total - cw_dist; i++) {
             path.push_back(get_output_port(direction, 0));
         }
     }
 }
 
-// Source-side all-in-one route computation.
-// Returns an stb array containing the series of routed output ports.
-std::vector<int> source_route_compute(Router *r, TopoDesc td, int src_id, int dst_id)
+// Draw the random choices of the route from src_id to dst_id: bit 'dir' is
+// set if the route goes toward larger coordinates in dimension 'dir', where
+// both ways are equally short.  The route itself can be computed later from
+// these with source_route_path().
+uint32_t source_route_dice(Router *r, TopoDesc td, int src_id, int dst_id)
+{
+    assert(td.r <= 32);
+    uint32_t dice = 0;
+    int last_src_id = src_id;
+    for (int dir = 0; dir < td.r; dir++) {
+        int interim_id = torus_align_id(td.k, last_src_id, dst_id, dir);
+        if (source_route_tied(td, last_src_id, interim_id, dir)) {
+            int roll = r->rand_gen.uni_dist(r->rand_gen.rng);
+            dice |= static_cast<uint32_t>(roll % 2 == 0) << dir;
+        }
+        last_src_id = interim_id;
+    }
+    return dice;
+}
+
+// Series of output ports from src_id to dst_id, given the random choices
+// drawn by source_route_dice().
+std::vector<int> source_route_path(TopoDesc td, int src_id, int dst_id,
+                                   uint32_t dice)
 {
     std::vector<int> path{};
 
@@ -377,7 +517,8 @@ std::vector<int> source_route_compute(Router *r, TopoDesc td, int src_id, int ds
     for (int dir = 0; dir < td.r; dir++) {
         int interim_id = torus_align_id(td.k, last_src_id, dst_id, dir);
         // printf("%s: from %d to %d\n", __func__, last_src_id, interim_id);
-        source_route_compute_dimension(r, td, last_src_id, interim_id, dir, path);
+        source_route_compute_dimension(td, last_src_id, interim_id, dir,
+                                       (dice >> dir) & 1, path);
         last_src_id = interim_id;
     }
     // Enter the final destination node.
@@ -386,6 +527,27 @@ std::vector<int> source_route_compute(Router *r, TopoDesc td, int src_id, int ds
     return path;
 }
 
+// Number of router-to-router hops from src_id to dst_id.
+int source_route_hops(TopoDesc td, int src_id, int dst_id)
+{
+    int hops = 0;
+    for (int dir = 0; dir < td.r; dir++) {
+        int src_id_xyz = torus_id_xyz_get(src_id, td.k, dir);
+        int dst_id_xyz = torus_id_xyz_get(dst_id, td.k, dir);
+        int cw_dist = (dst_id_xyz - src_id_xyz + td.k) % td.k;
+        hops += std::min(cw_dist, td.k - cw_dist);
+    }
+    return hops;
+}
+
+// Source-side all-in-one route computation.
+std::vector<int> source_route_compute(Router *r, TopoDesc td, int src_id,
+                                      int dst_id)
+{
+    uint32_t dice = source_route_dice(r, td, src_id, dst_id);
+    return source_route_path(td, src_id, dst_id, dice);
+}
+
 // Tick a router. This function does all of the work that a router has to
 // process in a single cycle, i.e. all pipeline stages and statistics update.
 // This simplifies the event system by streamlining event types into a single
@@ -393,11 +555,20 @@ std::vector<int> source_route_compute(Router *r, TopoDesc td, int src_id, int ds
 // chronological order between them.
 void router_tick(Router *r)
 {
+    Profile *prof = r->sim.profile.enabled ? &r->sim.profile : NULL;
+    uint64_t t = prof ? prof_clock() : 0;
+    if (prof) {
+        prof->tick_count++;
+    }
+
     // Make sure this router has not been already ticked in this cycle.
     if (curr_time(r->eventq) == r->last_tick) {
         // debugf(r, "WARN: double tick! curr_time=%ld, last_tick=%ld\n",
         //        curr_time(r->eventq), r->last_tick);
         r->stat->double_tick_count++;
+        if (prof) {
+            prof->double_tick_count++;
+        }
         return;
     }
 
@@ -406,13 +577,18 @@ void router_tick(Router *r)
     // Different tick actions for different types of node.
     if (is_src(r->id)) {
         source_generate(r);
+        prof_lap(prof, PROF_GENERATE, &t);
         // Source nodes also needs to manage credit in order to send flits at
         // the right time.
         credit_update(r);
+        prof_lap(prof, PROF_CREDIT, &t);
         fetch_credit(r);
+        prof_lap(prof, PROF_FETCH_CREDIT, &t);
     } else if (is_dst(r->id)) {
         destination_consume(r);
+        prof_lap(prof, PROF_CONSUME, &t);
         fetch_flit(r);
+        prof_lap(prof, PROF_FETCH_FLIT, &t);
     } else {
         // Process each pipeline stage.
         // Stages are processed in reverse dependency order to prevent coherence
@@ -420,12 +596,19 @@ void router_tick(Router *r)
         // VA stage, and then vc_alloc() is called, it would then get processed
         // again in the same cycle.
         switch_traverse(r);
+        prof_lap(prof, PROF_ST, &t);
         switch_alloc(r);
+        prof_lap(prof, PROF_SA, &t);
         vc_alloc(r);
+        prof_lap(prof, PROF_VA, &t);
         route_compute(r);
+        prof_lap(prof, PROF_RC, &t);
         credit_update(r);
+        prof_lap(prof, PROF_CREDIT, &t);
         fetch_credit(r);
+        prof_lap(prof, PROF_FETCH_CREDIT, &t);
         fetch_flit(r);
+        prof_lap(prof, PROF_FETCH_FLIT, &t);
 
         // Self-tick autonomously unless all input ports are empty.
         // FIXME: redundant?
@@ -446,6 +629,7 @@ void router_tick(Router *r)
 
     // Do the rescheduling at here once to prevent flooding the event queue.
     router_reschedule(r);
+    prof_lap(prof, PROF_UPDATE, &t);
 
     r->last_tick = curr_time(r->eventq);
 }
@@ -454,187 +638,334 @@ void router_tick(Router *r)
 /// Pipeline stages
 ///
 
-void source_generate(Router *r)
+// Account the packet 'p' that source 'r' just queued, generated at
+// 'gen_time', in the statistics and the packet ledger.  Its flits are
+// counted as of the cycles they are generated in.
+static void source_record_packet(Router *r, const SourcePacket &p,
+                                 long gen_time)
 {
-    // Before entering the source queue.
-    if (!queue_full(r->source_queue) &&
-        (r->eventq->curr_time() >= r->sg.next_packet_start ||
-         !r->sg.packet_finished)) {
+    PacketId packet_id{r->id.value, p.id};
+
+    // Hop count: exclude the last hop to terminal.
+    r->stat->hop_count_sum +=
+        source_route_hops(r->top_desc, r->id.value, p.dest);
+    r->stat->packet_gen_count++;
+
+    r->stat->flit_gen_count += p.len;
+    r->stat->window_flit_gen_count += source_packet_generated_between(
+        p, r->stat->measure_start, r->stat->measure_end);
+
+    // Record packet generation time.
+    bool tagged = stat_in_window(r->stat, gen_time);
+    r->stat->tagged_gen_count += tagged;
+    PacketTimestamp ts{
+        .gen = gen_time, .arr = -1, .len = p.len, .tagged = tagged, .inj = -1};
+    [[maybe_unused]] auto result =
+        r->stat->packet_ledger.insert({packet_id, ts});
+    assert(result.second);
+}
 
-        //
-        // Flit generation.
-        //
+// Queue a whole reply packet to 'dest' into the reply queue of source node
+// 'r', answering a request that was generated at 'req_time'.
+static void source_push_reply(Router *r, int dest, long req_time)
+{
+    long len = r->sim.reply_len;
+    long now = r->eventq->curr_time();
+    PacketId packet_id{r->id.value, r->sg.packet_counter++};
+
+    SourcePacket p;
+    p.id = packet_id.id;
+    p.req_time = req_time;
+    p.len = len;
+    p.head_time = now;
+    p.sent = 0;
+    p.dest = dest;
+    p.width = len;
+    p.route_dice = source_route_dice(r, r->top_desc, r->id.value, dest);
+    ring_put(&r->reply_queue, p);
+    source_record_packet(r, p, now);
+
+    debugf(r, "Reply generated to %d, len=%ld\n", dest, len);
+
+    // Wake up the source to send the reply.
+    router_wake(r, now + 1);
+}
 
-        int dest = -1;
-        if (r->traffic_desc.type == TRF_UNIFORM_RANDOM) {
-            while (true) {
-                dest = r->rand_gen.uni_dist(r->rand_gen.rd);
-                // Retry until an ID different than mine comes up.
-                if (dest != r->id.value) {
-                    break;
-                }
+// Materialize the next flit to send of packet 'p' of 'msg_class'.  Its
+// generation is traced here, back-dated to the cycle it was generated in.
+static Flit *source_flit_create(Router *r, const SourcePacket &p,
+                                int msg_class)
+{
+    long i = p.sent;
+    PacketId packet_id{r->id.value, p.id};
+    Flit *flit = new Flit{FLIT_BODY, 0, r->id.value, p.dest, packet_id, i};
+    trace_event_pkt(r, source_packet_flit_time(p, i), EV_GEN, packet_id, i,
+                    TERMINAL_PORT, 0);
+    flit->msg_class = msg_class;
+    flit->req_time = p.req_time;
+    if (i == 0) {
+        flit->type = (p.len == 1) ? FLIT_HEADTAIL : FLIT_HEAD;
+        flit->route_info.path =
+            source_route_path(r->top_desc, r->id.value, p.dest, p.route_dice);
+
+        if (DEBUG_LOG_ENABLED && r->verbose) {
+            debugf(r, "Source route computation: %d -> %d : {",
+                   flit->route_info.src, flit->route_info.dst);
+            for (size_t i = 0; i < flit->route_info.path.size(); i++) {
+                printf("%d,", flit->route_info.path[i]);
             }
-            debugf(r, "Uniform random: dest=%ld\n", dest);
-        } else if (r->traffic_desc.type == TRF_DESIGNATED) {
-            dest = r->traffic_desc.dests[r->id.value];
-        } else {
-            assert(false);
+            printf("}\n");
         }
+    } else if (i == p.len - 1) {
+        flit->type = FLIT_TAIL;
+    }
+    return flit;
+}
 
-        PacketId packet_id{r->id.value, r->sg.packet_counter};
-        Flit *flit = new Flit{FLIT_BODY, 0, r->id.value, dest,
-                        packet_id, r->sg.flitnum};
-
-        if (r->sg.packet_finished) {
-            // Head flit
-            //
-            if (r->eventq->curr_time() != r->sg.next_packet_start) {
-                debugf(r,
-                       "WARN: Head flit not generated at the scheduled "
-                       "time=%ld!\n",
-                       r->sg.next_packet_start);
+// Whether the source queue 'q' has a flit to send at cycle 'when'.
+static bool source_queue_ready(const Ring<SourcePacket> *q, long when)
+{
+    if (ring_empty(q)) {
+        return false;
+    }
+    const SourcePacket &p = ring_front(q);
+    return source_packet_generated(p, when) > p.sent;
+}
+
+// Send the next flit of the packet at the front of source queue 'q' through
+// the VCs of 'msg_class'.  Returns false if there is no flit generated yet or
+// the flit is stalled on credits, in which case '*stalled' is set.
+static bool source_send_flit(Router *r, Ring<SourcePacket> *q, int msg_class,
+                             bool *stalled)
+{
+    OutputVCs &ov = r->ovcs;
+    if (!source_queue_ready(q, r->eventq->curr_time())) {
+        return false;
+    }
+    Channel *och = r->output_channels[TERMINAL_PORT];
+    SourcePacket &p = ring_front(q);
+
+    int ovc_num = r->src_last_grant_output[msg_class];
+    if (p.sent == 0) {
+        // Deadlock avoidance with datelines: always start at the VCs with
+        // class 0.
+        const int ovc_class = 0; /* always */
+
+        // Round-robin VC arbitration among the VCs of the message class.
+        int vc_per_msg = r->vc_count / r->msg_class_count;
+        int vc_per_class = (vc_per_msg / r->vc_class_count);
+        int ovc_in_class =
+            (r->src_last_grant_output[msg_class] + 1) % vc_per_class;
+        for (int i = 0; i < r->vc_class_count; i++) {
+            ovc_num = msg_class * vc_per_msg + ovc_class * vc_per_class +
+                      ovc_in_class;
+            int ovc = vc_index(r, TERMINAL_PORT, ovc_num);
+            // Select the first one that has credits.
+            if (ov.credit_count[ovc] > 0) {
+                r->src_last_grant_output[msg_class] = ovc_num;
+                break;
             }
+            ovc_in_class = (ovc_in_class + 1) % vc_per_class;
+        }
+    }
 
-            //
-            // Source-side route computation.
-            //
+    int ovc = vc_index(r, TERMINAL_PORT, ovc_num);
+    if (ov.credit_count[ovc] > 0) {
+        Flit *ready_flit = source_flit_create(r, p, msg_class);
+        if (++p.sent == p.len) {
+            ring_pop(q);
+        }
+        // Make sure to mark the VC number in the flit.
+        ready_flit->vc_num = ovc_num;
+        channel_put(och, ready_flit);
+        trace_event(r, EV_INJECT, ready_flit, TERMINAL_PORT, ovc_num);
+
+        if (flit_is_head(ready_flit)) {
+            // Record injection time, for network latency vs. queueing delay.
+            auto f = r->stat->packet_ledger.find(ready_flit->packet_id);
+            assert(f != r->stat->packet_ledger.end());
+            f->second.inj = r->eventq->curr_time();
+        }
 
-            flit->type = FLIT_HEAD;
-            flit->route_info.path = source_route_compute(
-                r, r->top_desc, flit->route_info.src, flit->route_info.dst);
-            assert(flit->route_info.path.size() > 0);
+        debugf(r, "Source credit decrement, credit=%d->%d\n",
+               ov.credit_count[ovc], ov.credit_count[ovc] - 1);
+        ov.credit_count[ovc]--;
+        assert(ov.credit_count[ovc] >= 0);
 
-            // Hop count: exclude the last hop to terminal.
-            r->stat->hop_count_sum += (flit->route_info.path.size() - 1);
-            r->stat->packet_gen_count++;
+        r->flit_depart_count++;
 
-            if (r->verbose) {
-                debugf(r, "Source route computation: %d -> %d : {",
-                       flit->route_info.src, flit->route_info.dst);
-                for (size_t i = 0; i < flit->route_info.path.size(); i++) {
-                    printf("%d,", flit->route_info.path[i]);
-                }
-                printf("}\n");
-            }
+        char s[IDSTRLEN], s2[IDSTRLEN];
+        auto dst_pair = och->conn.dst;
+        debugf(r, "Flit sent via VC%d: %s, to {%s, %d}\n", ovc_num,
+               flit_str(ready_flit, s), id_str(dst_pair.id, s2),
+               dst_pair.port);
+        return true;
+    } else {
+        debugf(r, "Credit stall!\n");
+        *stalled = true;
+        return false;
+    }
+}
 
-            r->sg.flitnum++;
-
-            // Set the time the next packet is generated.
-            //
-            // Fixed interval:
-            // r->sg.next_packet_start = r->eventq->curr_time() + r->packet_len;
-            //
-            // Poisson process:
-            double next_packet_start_frac =
-                static_cast<double>(r->eventq->curr_time()) +
-                static_cast<double>(r->packet_len) +
-                r->rand_gen.exp_dist(r->rand_gen.rd);
-            r->sg.next_packet_start = std::lround(next_packet_start_frac);
-            // if (r->sg.next_packet_start < r->eventq->curr_time() + r->packet_len) {
-            //     printf("nah\n");
-            //     r->sg.next_packet_start = r->eventq->curr_time() + r->packet_len;
-            // }
-            // debugf(r, "scheduling at %ld\n", r->sg.next_packet_start);
-            schedule(r->eventq, r->sg.next_packet_start,
-                     tick_event_from_id(r->id));
-
-            // Record packet generation time.
-            PacketTimestamp ts{.gen = r->eventq->curr_time(), .arr = -1};
-            auto result = r->stat->packet_ledger.insert({flit->packet_id, ts});
-            assert(result.second);
-
-            r->sg.packet_finished = false;
-        } else if (r->sg.flitnum == r->packet_len - 1) {
-            // Tail flit
-            flit->type = FLIT_TAIL;
-            r->sg.flitnum = 0;
-            r->sg.packet_finished = true;
-            r->sg.packet_counter++;
-        } else {
-            // Body flit
-            r->sg.flitnum++;
-        }
+// Generate a new request packet at the source 'r' at cycle 'now'.  The whole
+// packet is queued at once; its flits are generated up to the terminal width
+// per cycle from 'now' on, as worked out by source_packet_generated().
+static void source_generate_packet(Router *r, long now)
+{
+    // Pick the destination and the length of a new packet.
+    int dest;
+    long len, gen_time;
+    if (r->sim.trace) {
+        TraceRecord rec = trace_pop(r->sim.trace, r->id.value);
+        dest = rec.dst;
+        len = rec.size;
+        gen_time = rec.time;
+        debugf(r, "Trace: dest=%d, size=%d\n", rec.dst, rec.size);
+    } else {
+        dest = traffic_dest(r->traffic_desc, r->id.value, r->rand_gen);
+        len = packet_len_sample(r->sim.packet_len_desc, r->rand_gen);
+        // The Markov-modulated processes keep the exact arrival time even if
+        // the source was busy with the previous packet.  Closed-loop requests
+        // are timed from when they are issued.
+        gen_time =
+            (r->sim.injection.type == INJ_POISSON || r->sim.closed_loop)
+                ? now
+                : r->sg.next_packet_start;
+        debugf(r, "%s: dest=%d\n", traffic_str(r->traffic_desc.type), dest);
+    }
+    PacketId packet_id{r->id.value, r->sg.packet_counter++};
 
-        if (!r->sg.packet_finished) {
-            r->reschedule_next_tick = true;
+    //
+    // Source-side route computation.  Only the random choices are made here;
+    // the path is put in the head flit when it is sent.
+    //
+
+    SourcePacket p;
+    p.id = packet_id.id;
+    p.req_time = -1;
+    p.len = len;
+    p.head_time = now;
+    p.sent = 0;
+    p.dest = dest;
+    p.width = r->sim.injection.gen_width;
+    p.route_dice = source_route_dice(r, r->top_desc, r->id.value, dest);
+    ring_put(&r->source_queue, p);
+    long gen_cycles = source_packet_gen_cycles(p);
+    r->sg.gen_free = now + gen_cycles;
+    source_record_packet(r, p, gen_time);
+
+    // Set the time the next packet arrives.  The source is woken up for it by
+    // source_schedule_generation().
+    if (r->sim.trace) {
+        // Trace-driven: the next pending record of this source, if any.
+        // Otherwise, the trace reader wakes us up later.
+        const TraceRecord *next = trace_peek(r->sim.trace, r->id.value);
+        r->sg.next_packet_start = next ? next->time : LONG_MAX;
+    } else if (r->sim.injection.type != INJ_POISSON) {
+        // Bernoulli and Markov-modulated processes: jump straight to the next
+        // arrival, without ticking the idle cycles between.
+        const InjectionDesc &inj = r->sim.injection;
+        if (r->sg.inj_state < 0) {
+            r->sg.inj_state = injection_initial_state(inj, r->rand_gen);
         }
+        r->sg.next_packet_start = injection_next_arrival(
+            inj, gen_time, &r->sg.inj_state, r->rand_gen);
+    } else {
+        // Poisson process, starting after the packet is done generating.
+        double next_packet_start_frac = static_cast<double>(now) +
+                                        static_cast<double>(gen_cycles) +
+                                        r->rand_gen.exp_dist(r->rand_gen.rng);
+        r->sg.next_packet_start = std::lround(next_packet_start_frac);
+    }
 
-        queue_put(r->source_queue, flit);
+    if (r->sim.trace_dump) {
+        TraceRecord rec = {gen_time, r->id.value, dest,
+                           static_cast<int32_t>(len), 0};
+        trace_writer_put(r->sim.trace_dump, rec);
+    }
 
-        char s[IDSTRLEN];
-        debugf(r, "Flit generated: %s\n", flit_str(flit, s));
-        debugf(r, "Source queue len=%ld\n", queue_len(r->source_queue));
-    } else if (queue_full(r->source_queue)) {
-        debugf(r, "WARN: source queue full!\n");
-    }
-
-    // After exiting the source queue.
-    if (!queue_empty(r->source_queue)) {
-        Flit *ready_flit = queue_front(r->source_queue);
-
-        int ovc_num = r->src_last_grant_output;
-        if (ready_flit->type == FLIT_HEAD) {
-            // Deadlock avoidance with datelines: always start at the VCs with
-            // class 0.
-            const int ovc_class = 0; /* always */
-
-            // Round-robin VC arbitration
-            int vc_per_class = (r->vc_count / r->vc_class_count);
-            int ovc_in_class = (r->src_last_grant_output + 1) % vc_per_class;
-            for (int i = 0; i < r->vc_class_count; i++) {
-                ovc_num = ovc_class * vc_per_class + ovc_in_class;
-                OutputUnit::VC &ovc = r->output_units[TERMINAL_PORT].vcs[ovc_num];
-                // Select the first one that has credits.
-                if (ovc.credit_count > 0) {
-                    r->src_last_grant_output = ovc_num;
-                    break;
-                }
-                ovc_in_class = (ovc_in_class + 1) % vc_per_class;
-            }
+    if (r->sim.closed_loop) {
+        r->sg.outstanding++;
+    }
+
+    debugf(r, "Packet generated: %ld.%ld, len=%ld\n", packet_id.src,
+           packet_id.id, len);
+    debugf(r, "Source queue len=%zu packets\n", ring_len(&r->source_queue));
+}
+
+// Wake up the source 'r' when the next packet can be generated: once it has
+// arrived and the previous packet is done generating.  At most one wake-up is
+// kept pending, so that a source ticked for other reasons does not pile up
+// events.
+static void source_schedule_generation(Router *r)
+{
+    if (r->sg.next_packet_start == LONG_MAX) {
+        return;
+    }
+    long when = std::max(r->sg.next_packet_start, r->sg.gen_free);
+    assert(when > r->eventq->curr_time());
+    if (when != r->sg.gen_wake) {
+        router_wake(r, when);
+        r->sg.gen_wake = when;
+    }
+}
+
+void source_generate(Router *r)
+{
+    long now = r->eventq->curr_time();
+
+    // In the closed-loop mode, a new request cannot start until a reply comes
+    // back for one of the outstanding requests, which wakes the source up.
+    bool throttled = r->sim.closed_loop &&
+                     r->sg.outstanding >= r->sim.max_outstanding;
+
+    // Before entering the source queue.
+    if (!throttled) {
+        if (now >= r->sg.next_packet_start && now >= r->sg.gen_free) {
+            source_generate_packet(r, now);
+            throttled = r->sim.closed_loop &&
+                        r->sg.outstanding >= r->sim.max_outstanding;
+        }
+        if (!throttled) {
+            source_schedule_generation(r);
         }
+    }
 
-        OutputUnit::VC &ovc = r->output_units[TERMINAL_PORT].vcs[ovc_num];
-        if (ovc.credit_count > 0) {
-            queue_pop(r->source_queue);
-            // Make sure to mark the VC number in the flit.
-            ready_flit->vc_num = ovc_num;
-            Channel *och = r->output_channels[TERMINAL_PORT];
-            channel_put(och, ready_flit);
-
-            debugf(r, "Source credit decrement, credit=%d->%d\n",
-                   ovc.credit_count, ovc.credit_count - 1);
-            ovc.credit_count--;
-            assert(ovc.credit_count >= 0);
-
-            r->flit_depart_count++;
-
-            char s[IDSTRLEN], s2[IDSTRLEN];
-            auto dst_pair = och->conn.dst;
-            debugf(r, "Flit sent via VC%d: %s, to {%s, %d}\n", ovc_num,
-                   flit_str(ready_flit, s), id_str(dst_pair.id, s2),
-                   dst_pair.port);
-
-            // Infinitely generate flits.
-            // TODO: Set and control generation rate.
-            r->reschedule_next_tick = 1;
-        } else {
-            debugf(r, "Credit stall!\n");
+    // After exiting the source queues.
+    // The injection channel may take multiple flits per cycle if it is wide.
+    // Replies go first, so that they are never held up by requests.
+    Channel *och = r->output_channels[TERMINAL_PORT];
+    bool reply_stalled = false, req_stalled = false;
+    for (int lane = 0; lane < och->width; lane++) {
+        if (!source_send_flit(r, &r->reply_queue, MSG_REPLY, &reply_stalled) &&
+            !source_send_flit(r, &r->source_queue, MSG_REQUEST,
+                              &req_stalled)) {
+            break;
         }
     }
+
+    // Tick again only if there is a flit to send next cycle.  A source stalled
+    // on credits is woken up by credit_update() instead.
+    if ((!reply_stalled && source_queue_ready(&r->reply_queue, now + 1)) ||
+        (!req_stalled && source_queue_ready(&r->source_queue, now + 1))) {
+        r->reschedule_next_tick = 1;
+    }
 }
 
-void destination_consume(Router *r)
+// Consume a single flit from the input VCs.  Returns false if there was none.
+static bool destination_consume_flit(Router *r)
 {
     // Round-robin input VC selection.  Destination node should never block, so
     // keep searching for a non-empty input VC in the single cycle.
-    InputUnit::VC *ivc = NULL;
+    InputVCs &iv = r->ivcs;
+    int ivc = -1;
     char s[IDSTRLEN], s2[IDSTRLEN];
 
     bool has_nonempty_ivc = false;
     int ivc_num = (r->dst_last_grant_input + 1) % r->vc_count;
     for (int i = 0; i < r->vc_count; i++) {
-        ivc = &r->input_units[TERMINAL_PORT].vcs[ivc_num];
-        if (!queue_empty(ivc->buf)) {
+        ivc = vc_index(r, TERMINAL_PORT, ivc_num);
+        if (!ivc_empty(iv, ivc)) {
             has_nonempty_ivc = true;
             r->dst_last_grant_input = ivc_num;
             break;
@@ -644,17 +975,19 @@ void destination_consume(Router *r)
     if (!has_nonempty_ivc) {
         // Ideally, the destination node should have never even been scheduled
         // in this case.
-        return;
+        return false;
     }
 
-    assert(!queue_empty(ivc->buf));
-    Flit *flit = queue_front(ivc->buf);
+    assert(!ivc_empty(iv, ivc));
+    Flit *flit = ivc_front(iv, ivc);
 
-    if (flit->type == FLIT_HEAD) {
+    if (flit_is_head(flit)) {
         // First, check if this flit is correctly destined to this node.
         assert(flit->route_info.dst == r->id.value);
+    }
 
-        // Record packet arrival time.
+    if (flit_is_tail(flit)) {
+        // Record packet arrival time, i.e. when the whole packet arrived.
         // debugf(r, "Finding packet ID=%ld,%ld\n", flit->packet_id.src,
         // flit->packet_id.id);
         auto f = r->stat->packet_ledger.find(flit->packet_id);
@@ -667,13 +1000,54 @@ void destination_consume(Router *r)
         f->second.arr = r->eventq->curr_time();
         long arr = f->second.arr;
         long gen = f->second.gen;
+        long len = f->second.len;
+        long inj = f->second.inj;
+        bool tagged = f->second.tagged;
         long latency = arr - gen;
         // debugf(r, "Deleting packet ID=%ld,%ld\n",
         // flit->packet_id.src, flit->packet_id.id);
         r->stat->packet_ledger.erase(flit->packet_id);
 
-        r->stat->latency_sum += latency;
-        r->stat->packet_arrive_count++;
+        // Only the packets generated in the measurement window are sampled.
+        if (tagged) {
+            r->stat->latency_sum += latency;
+            r->stat->packet_arrive_count++;
+            SizeStat &ss = r->stat->size_stats[len];
+            ss.latency_sum += latency;
+            ss.packet_arrive_count++;
+
+            hist_record(&r->stat->packet_hist, latency);
+            hist_record(&r->stat->network_hist, arr - inj);
+            hist_record(&r->stat->queueing_hist, inj - gen);
+            if (r->stat->pair_hist_nodes > 0) {
+                size_t pair = flit->packet_id.src * r->stat->pair_hist_nodes +
+                              r->id.value;
+                Hist *&h = r->stat->pair_hists[pair];
+                if (!h) {
+                    h = new Hist;
+                    hist_init(h);
+                }
+                hist_record(h, latency);
+            }
+        }
+
+        if (r->sim.closed_loop) {
+            // The source node of this terminal sends the reply, and keeps
+            // track of the outstanding requests.
+            Router *src = r->sim.src_nodes[r->id.value];
+            if (flit->msg_class == MSG_REQUEST) {
+                source_push_reply(src, flit->route_info.src, gen);
+            } else {
+                if (stat_in_window(r->stat, flit->req_time)) {
+                    r->stat->rtt_sum += arr - flit->req_time;
+                    r->stat->reply_arrive_count++;
+                }
+                assert(src->sg.outstanding > 0);
+                src->sg.outstanding--;
+                // Wake up the source in case it was throttled.
+                router_wake(src, arr + 1);
+            }
+        }
 
         debugf(r,
                "Packet arrived: %s, latency=%ld (arr=%ld, gen=%ld). "
@@ -682,12 +1056,15 @@ void destination_consume(Router *r)
                r->stat->packet_ledger.size());
     }
 
-    debugf(r, "Destination buf size=%zd\n", queue_len(ivc->buf));
+    debugf(r, "Destination buf size=%zd\n", ivc_len(iv, ivc));
     debugf(r, "Flit arrived via VC%d: %s\n", ivc_num, flit_str(flit, s));
 
     r->flit_arrive_count++;
-    queue_pop(ivc->buf);
-    assert(queue_empty(ivc->buf));
+    trace_event(r, EV_EJECT, flit, TERMINAL_PORT, ivc_num);
+    r->stat->window_flit_arrive_count +=
+        stat_in_window(r->stat, r->eventq->curr_time());
+    ivc_pop(iv, ivc);
+    assert(ivc_empty(iv, ivc));
 
     Channel *ich = r->input_channels[TERMINAL_PORT];
     std::vector<long> vc_nums{ivc_num};
@@ -696,6 +1073,7 @@ void destination_consume(Router *r)
     if (true || (r->id.value != 22)) {
         Credit *credit = new Credit{vc_nums};
         channel_put_credit(ich, credit);
+        trace_event(r, EV_CREDIT, NULL, TERMINAL_PORT, ivc_num);
         RouterPortPair src_pair = ich->conn.src;
         RouterPortPair dst_pair = ich->conn.dst;
         debugf(r, "Credit sent via VC%d from {%s, %d} to {%s, %d}\n", ivc_num,
@@ -703,147 +1081,177 @@ void destination_consume(Router *r)
                src_pair.port);
     }
 
-    // Self-tick autonomously unless all input ports are empty.
-    r->reschedule_next_tick = true;
-
     delete flit;
+    return true;
+}
+
+void destination_consume(Router *r)
+{
+    // Drain as many flits as the ejection channel can deliver in a cycle, so
+    // that the destination never blocks.
+    int width = r->input_channels[TERMINAL_PORT]->width;
+    for (int lane = 0; lane < width; lane++) {
+        if (!destination_consume_flit(r)) {
+            break;
+        }
+    }
+
+    // Self-tick only while flits are left.  Otherwise, fetch_flit() wakes up
+    // the node on the next arrival.
+    for (int ivc = 0; ivc < r->ivcs.count; ivc++) {
+        if (!ivc_empty(r->ivcs, ivc)) {
+            r->reschedule_next_tick = true;
+            break;
+        }
+    }
 }
 
 void fetch_flit(Router *r)
 {
-    for (int iport = 0; iport < r->radix; iport++) {
+    InputVCs &iv = r->ivcs;
+    for (int iport = bitmap_next(r->flit_pending, r->port_words, 0);
+         iport >= 0;
+         iport = bitmap_next(r->flit_pending, r->port_words, iport + 1)) {
         Channel *ich = r->input_channels[iport];
-        Flit *flit = channel_get(ich);
-        if (!flit) {
-            continue;
-        }
+        // A wide channel may deliver multiple flits in a single cycle.
+        Flit *flit;
+        while ((flit = channel_get(ich)) != NULL) {
+            int ivc = vc_index(r, iport, flit->vc_num);
 
-        InputUnit::VC &ivc = r->input_units[iport].vcs[flit->vc_num];
+            char s[IDSTRLEN];
+            debugf(r, "Fetched flit %s via VC%ld, buf[%d][%ld].size()=%zd\n",
+                   flit_str(flit, s), flit->vc_num, iport, flit->vc_num,
+                   ivc_len(iv, ivc));
+
+            // If the buffer was empty, this is the only place to kickstart
+            // the pipeline.
+            if (ivc_empty(iv, ivc)) {
+                // debugf(r, "fetch_flit: buf was empty\n");
+                // If the input unit state was also idle (empty != idle!),
+                // set the stage to RC.
+                if (iv.next_global[ivc] == STATE_IDLE) {
+                    // Idle -> RC transition
+                    ivc_set_next(iv, ivc, STATE_ROUTING);
+                    iv.stage[ivc] = PIPELINE_RC;
+                }
 
-        char s[IDSTRLEN];
-        debugf(r, "Fetched flit %s via VC%d, buf[%d][%d].size()=%zd\n",
-               flit_str(flit, s), flit->vc_num, iport, flit->vc_num,
-               queue_len(ivc.buf));
-
-        // If the buffer was empty, this is the only place to kickstart the
-        // pipeline.
-        if (queue_empty(ivc.buf)) {
-            // debugf(r, "fetch_flit: buf was empty\n");
-            // If the input unit state was also idle (empty != idle!), set
-            // the stage to RC.
-            if (ivc.next_global == STATE_IDLE) {
-                // Idle -> RC transition
-                ivc.next_global = STATE_ROUTING;
-                ivc.stage = PIPELINE_RC;
+                r->reschedule_next_tick = true;
             }
 
-            r->reschedule_next_tick = true;
-        }
-
-        assert(!queue_full(ivc.buf));
-        queue_put(ivc.buf, flit);
+            assert(!ivc_full(iv, ivc));
+            ivc_occupancy_update(iv, ivc, curr_time(r->eventq));
+            ivc_put(iv, ivc, flit);
+            trace_event(r, EV_BW, flit, iport, flit->vc_num);
 
-        assert(queue_len(ivc.buf) <= r->input_buf_size &&
-               "Input buffer overflow!");
+            assert(ivc_len(iv, ivc) <= r->input_buf_size &&
+                   "Input buffer overflow!");
+        }
+        if (ring_empty(&ich->buf)) {
+            bitmap_clear(r->flit_pending, iport);
+        }
     }
 }
 
 void fetch_credit(Router *r)
 {
-    for (int oport = 0; oport < r->radix; oport++) {
+    OutputVCs &ov = r->ovcs;
+    for (int oport = bitmap_next(r->credit_pending, r->port_words, 0);
+         oport >= 0;
+         oport = bitmap_next(r->credit_pending, r->port_words, oport + 1)) {
         Channel *och = r->output_channels[oport];
-        Credit *credit = channel_get_credit(och);
-        if (credit) {
+        // A wide channel may deliver multiple credits in a single cycle.
+        Credit *credit;
+        while ((credit = channel_get_credit(och)) != NULL) {
             debugf(r, "Fetched credit, oport=%d\n", oport);
             for (auto vc_num : credit->vc_nums) {
-                OutputUnit::VC &ovc = r->output_units[oport].vcs[vc_num];
+                int ovc = vc_index(r, oport, vc_num);
                 // In any time, there should be at most 1 credit in the buffer.
-                assert(!ovc.buf_credit);
-                ovc.buf_credit = true;
+                assert(!bitmap_test(ov.credit_set, ovc));
+                bitmap_set(ov.credit_set, ovc);
                 r->reschedule_next_tick = true;
             }
             delete credit;
         }
+        if (ring_empty(&och->buf_credit)) {
+            bitmap_clear(r->credit_pending, oport);
+        }
     }
 }
 
 void credit_update(Router *r)
 {
-    for (int oport = 0; oport < r->radix; oport++) {
-        for (int ovc_num = 0; ovc_num < r->vc_count; ovc_num++) {
-            OutputUnit::VC &ovc = r->output_units[oport].vcs[ovc_num];
-
-            if (ovc.buf_credit) {
-                debugf(r, "CU: credit=%d->%d (oport=%d)\n",
-                       ovc.credit_count, ovc.credit_count + 1, oport);
-                assert(ovc.input_port != -1);
-                assert(ovc.input_vc != -1);
-
-                // Upon credit update, the input and output unit receiving this
-                // credit may or may not be in the CreditWait state.  If they
-                // are, make sure to switch them back to the active state so
-                // that they can proceed in the SA stage.
-                //
-                // This can otherwise be implemented in the SA stage itself,
-                // switching the stage to Active and simultaneously commencing
-                // to the switch allocation.  However, this implementation seems
-                // to defeat the purpose of the CreditWait stage. This
-                // implementation is what I think of as a more natural one.
-                InputUnit::VC &ivc =
-                    r->input_units[ovc.input_port].vcs[ovc.input_vc];
-                if (ovc.credit_count == 0) {
-                    if (ovc.next_global == STATE_CREDWAIT) {
-                        assert(ivc.next_global == STATE_CREDWAIT);
-                        ivc.next_global = STATE_ACTIVE;
-                        ovc.next_global = STATE_ACTIVE;
-                    }
-                    r->reschedule_next_tick = true;
-                    // debugf(r, "credit update with kickstart! (iport=%d)\n",
-                    //         ovc.input_port);
-                } else {
-                    // debugf(r, "credit update, but no kickstart
-                    // (credit=%d)\n",
-                    //         ovc.credit_count);
-                }
-
-                ovc.credit_count++;
-                // queue_pop(ovc.buf_credit);
-                // assert(queue_empty(ovc.buf_credit));
-                ovc.buf_credit = false;
-            } else {
-                // dbg() << "No credit update, oport=" << oport << std::endl;
+    InputVCs &iv = r->ivcs;
+    OutputVCs &ov = r->ovcs;
+    for (int ovc = bitmap_next(ov.credit_set, ov.words, 0); ovc >= 0;
+         ovc = bitmap_next(ov.credit_set, ov.words, ovc + 1)) {
+        debugf(r, "CU: credit=%d->%d (oport=%d)\n", ov.credit_count[ovc],
+               ov.credit_count[ovc] + 1, ovc / r->vc_count);
+        assert(ov.input_port[ovc] != -1);
+        assert(ov.input_vc[ovc] != -1);
+
+        // Upon credit update, the input and output unit receiving this
+        // credit may or may not be in the CreditWait state.  If they are,
+        // make sure to switch them back to the active state so that they can
+        // proceed in the SA stage.
+        //
+        // This can otherwise be implemented in the SA stage itself, switching
+        // the stage to Active and simultaneously commencing to the switch
+        // allocation.  However, this implementation seems to defeat the
+        // purpose of the CreditWait stage. This implementation is what I
+        // think of as a more natural one.
+        int ivc = vc_index(r, ov.input_port[ovc], ov.input_vc[ovc]);
+        if (ov.credit_count[ovc] == 0) {
+            if (ov.next_global[ovc] == STATE_CREDWAIT) {
+                assert(iv.next_global[ivc] == STATE_CREDWAIT);
+                ivc_set_next(iv, ivc, STATE_ACTIVE);
+                ovc_set_next(ov, ovc, STATE_ACTIVE);
+                // Even if it only entered CreditWait in this cycle, and
+                // update_states() sees no change.
+                r->reschedule_next_tick = true;
+            }
+            // Otherwise, only a source with a flit stalled on this credit
+            // needs another tick.
+            if (is_src(r->id) &&
+                (source_queue_ready(&r->reply_queue, curr_time(r->eventq) + 1) ||
+                 source_queue_ready(&r->source_queue,
+                                    curr_time(r->eventq) + 1))) {
+                r->reschedule_next_tick = true;
             }
+            // debugf(r, "credit update with kickstart! (iport=%d)\n",
+            //         ov.input_port[ovc]);
         }
+
+        ov.credit_count[ovc]++;
+        bitmap_clear(ov.credit_set, ovc);
     }
 }
 
 void route_compute(Router *r)
 {
-    for (int iport = 0; iport < r->radix; iport++) {
-        for (int ivc_num = 0; ivc_num < r->vc_count; ivc_num++) {
-            InputUnit::VC &ivc = r->input_units[iport].vcs[ivc_num];
+    InputVCs &iv = r->ivcs;
+    for (int ivc = bitmap_next(iv.routing_set, iv.words, 0); ivc >= 0;
+         ivc = bitmap_next(iv.routing_set, iv.words, ivc + 1)) {
+        assert(iv.global[ivc] == STATE_ROUTING);
+        assert(!ivc_empty(iv, ivc));
+        Flit *flit = ivc_front(iv, ivc);
+
+        assert(flit_is_head(flit));
+        assert(flit->route_info.idx < flit->route_info.path.size());
+        const RouteInfo &ri = flit->route_info;
+        iv.route_port[ivc] = ri.path[ri.idx];
+        // iv.output_vc[ivc] will be set in the VA stage.
 
-            if (ivc.global == STATE_ROUTING) {
-                assert(!queue_empty(ivc.buf));
-                Flit *flit = queue_front(ivc.buf);
-
-                assert(flit->type == FLIT_HEAD);
-                assert(flit->route_info.idx < flit->route_info.path.size());
-                ivc.route_port = flit->route_info.path[flit->route_info.idx];
-                // ivc.output_vc will be set in the VA stage.
-
-                char s[IDSTRLEN];
-                debugf(r, "RC: success for %s (idx=%zu, oport=%d)\n",
-                       flit_str(flit, s), flit->route_info.idx, ivc.route_port);
+        char s[IDSTRLEN];
+        debugf(r, "RC: success for %s (idx=%zu, oport=%d)\n",
+               flit_str(flit, s), ri.idx, iv.route_port[ivc]);
+        trace_event(r, EV_RC, flit, ivc / r->vc_count, ivc % r->vc_count);
 
-                flit->route_info.idx++;
+        flit->route_info.idx++;
 
-                // RC -> VA transition
-                ivc.next_global = STATE_VCWAIT;
-                ivc.stage = PIPELINE_VA;
-                r->reschedule_next_tick = true;
-            }
-        }
+        // RC -> VA transition
+        ivc_set_next(iv, ivc, STATE_VCWAIT);
+        iv.stage[ivc] = PIPELINE_VA;
+        r->reschedule_next_tick = true;
     }
 }
 
@@ -912,277 +1320,168 @@ int sa_arbit_round_robin(Router *r, int out_port)
 
 #endif
 
-static size_t alloc_vector_pos(size_t grant_size, size_t input_vc,
-                                 size_t output_vc)
-{
-    return (input_vc * grant_size) + output_vc;
-}
-
-// Returns the index of the granted input.
-// Accepts a large concatenation of all (xVC) request and grant vectors, and
-// modifies the grant vectors in-place.
-//
-// 'req_size': number of requests/grants waiting for allocation.
-// 'grant_size': number of resources available for grant.
-// 'which': for which req (if is_input_stage == 1) or grant (if is_input_stage
-//          == 0) should I arbitrate at this iteration?
-// 'is_input_stage': true of this is input arbitration, false if output
-// arbitration.
+// Virtual channel allocation stage.
+// Performs a (# of total input VCs) X (# of total output VCs) allocation.
 //
-// Returns the VC (global index) whose request won the grant.
-size_t round_robin_arbitration(size_t req_size, size_t grant_size, size_t which, bool is_input_stage,
-                               size_t last_grant,
-                               const std::vector<bool> &request_vectors,
-                               std::vector<bool> &grant_vectors)
-{
-    size_t arbit_size = is_input_stage ? grant_size : req_size;
-
-    // Clear the grant vector first.
-    for (size_t i = 0; i < arbit_size; i++) {
-        if (is_input_stage) {
-            grant_vectors[alloc_vector_pos(grant_size, which, i)] = false;
-        } else {
-            grant_vectors[alloc_vector_pos(grant_size, i, which)] = false;
-        }
-    }
-
-    size_t candidate = (last_grant + 1) % arbit_size;
-    for (size_t i = 0; i < arbit_size; i++) {
-        size_t cand_pos;
-        if (is_input_stage) {
-            cand_pos = alloc_vector_pos(grant_size, which, candidate);
-        } else {
-            cand_pos = alloc_vector_pos(grant_size, candidate, which);
-        }
-
-        if (request_vectors[cand_pos]) {
-            grant_vectors[cand_pos] = true;
-            return cand_pos;
-        }
-
-        candidate = (candidate + 1) % arbit_size;
-    }
-
-    // Indicates that there was no request.
-    return -1;
-}
-
-// Only makes sense for the output arbitration.
-size_t age_based_arbitration(size_t req_size, size_t grant_size, size_t which,
-                             bool is_input_stage, size_t last_grant,
-                             const std::vector<bool> &request_vectors,
-                             std::vector<bool> &grant_vectors,
-                             const std::vector<long> &age_vector)
+// Separable (input-first) allocator with round-robin arbiters.  Each input VC
+// in VCWait requests the output VCs of its class at its route port; the input
+// arbiter picks one of them, and the arbiter of each output VC that is Idle
+// picks one of the input VCs that picked it.  Only the input VCs in VCWait
+// and the output VCs they picked are visited.
+void vc_alloc(Router *r)
 {
-    assert(!is_input_stage);
-    size_t arbit_size = is_input_stage ? grant_size : req_size;
+    InputVCs &iv = r->ivcs;
+    OutputVCs &ov = r->ovcs;
+    Router::Allocator &a = r->alloc;
 
-    // Clear the grant vector first.
-    for (size_t i = 0; i < arbit_size; i++) {
-        if (is_input_stage) {
-            grant_vectors[alloc_vector_pos(grant_size, which, i)] = false;
-        } else {
-            grant_vectors[alloc_vector_pos(grant_size, i, which)] = false;
-        }
+    if (bitmap_next(iv.vcwait_set, iv.words, 0) < 0) {
+        return;
     }
+    int total_vc = r->radix * r->vc_count;
+
+    // Step 1: Input arbitration.  The requests of an input VC are the
+    // 'vc_per_class' output VCs from 'ovc_base' on, and the winner is the
+    // first of them from the round-robin pointer on.  The output arbitration
+    // is prepared on the way, by keeping the input VC closest to the pointer
+    // of each output VC.
+    int num_req = 0;
+    for (int ivc = bitmap_next(iv.vcwait_set, iv.words, 0); ivc >= 0;
+         ivc = bitmap_next(iv.vcwait_set, iv.words, ivc + 1)) {
+        int iport = ivc / r->vc_count;
+        int ivc_num = ivc % r->vc_count;
+        assert(iv.global[ivc] == STATE_VCWAIT);
+        assert(iv.route_port[ivc] >= 0);
+        assert(!ivc_empty(iv, ivc));
+        num_req++;
 
-    // Find the request with oldest packet.
-    long min_birth = LONG_MAX;
-    size_t min_so_far = 0;
-    long howmany = 0;
-    for (size_t i = 0; i < arbit_size; i++) {
-        size_t cand_pos;
-        if (is_input_stage) {
-            cand_pos = alloc_vector_pos(grant_size, which, i);
-        } else {
-            cand_pos = alloc_vector_pos(grant_size, i, which);
-        }
+        //
+        // Deadlock avoidance: Datelines.
+        //
 
-        if (request_vectors[cand_pos]) {
-            howmany++;
-            long birth = age_vector[i];
-            if (birth < min_birth) {
-                min_birth = birth;
-                min_so_far = cand_pos;
+        // Dateline is between the router 3 and 0.
+        //
+        // If going to the same direction, only allocate VCs with the same
+        // number as IVC.  Whenever crossing the dateline, allocate VC with a
+        // higher number.
+        //
+        // Protocol deadlock avoidance: a packet stays in the VC set of its
+        // message class all the way.
+        //
+        int vc_per_msg = r->vc_count / r->msg_class_count;
+        int vc_per_class = vc_per_msg / r->vc_class_count;
+        int msg_class = ivc_num / vc_per_msg;
+        int in_direction = (iport - 1) / 2;
+        int out_direction = (iv.route_port[ivc] - 1) / 2;
+        int ivc_class = (ivc_num % vc_per_msg) / vc_per_class;
+        int ovc_class =
+            (iport != TERMINAL_PORT && in_direction == out_direction)
+                ? ivc_class
+                : 0;
+        int id_in_ring =
+            torus_id_xyz_get(r->id.value, r->top_desc.k, out_direction);
+        if (r->vc_class_count > 1) {
+            if ((id_in_ring == (r->top_desc.k - 1) &&
+                 iv.route_port[ivc] == get_output_port(out_direction, 1)) ||
+                (id_in_ring == 0 &&
+                 iv.route_port[ivc] == get_output_port(out_direction, 0))) {
+                // If going out to the same direction as coming in, check
+                // that IVC was being maintained as 0.
+                if (iport != TERMINAL_PORT && in_direction == out_direction) {
+                    assert(ivc_class == 0);
+                }
+                ovc_class = 1;
+                debugf(r, "VA: crossing dateline. Reallocating VC=%d->%d.\n", ivc_class, ovc_class);
             }
         }
-    }
-
-    if (min_birth != LONG_MAX) {
-        grant_vectors[min_so_far] = true;
-        return min_so_far;
-    }
-
-    // Indicates that there was no request.
-    return -1;
-}
-
-// Virtual channel allocation stage.
-// Performs a (# of total input VCs) X (# of total output VCs) allocation.
-void vc_alloc(Router *r)
-{
-    //
-    // Separable (input-first) allocator.
-    //
-
-    // FIXME: PERFORMANCE!
-
-    size_t total_vc = r->radix * r->vc_count;
-    size_t vector_size = total_vc * total_vc;
-    // Request vectors for each input VC. Has 1 request bit for each output VC.
-    std::vector<bool> request_vectors(vector_size, false);
-    // Age vector, for age-based arbitration.
-    std::vector<long> age_vector(total_vc, LONG_MAX);
-    // Input arbitration result vector, i.e. the 'x' vector in Figure 19.4.
-    std::vector<bool> x_vectors(vector_size, false);
-    // Grant vectors.
-    std::vector<bool> grant_vectors(vector_size, false);
-
-    // Step 0: Prepare request vectors.
-    for (int iport = 0; iport < r->radix; iport++) {
-        for (int ivc_num = 0; ivc_num < r->vc_count; ivc_num++) {
-            InputUnit::VC &ivc = r->input_units[iport].vcs[ivc_num];
-
-            if (ivc.global == STATE_VCWAIT) {
-                assert(ivc.route_port >= 0);
-                size_t global_ivc = iport * r->vc_count + ivc_num;
-                size_t global_ovc_base = ivc.route_port * r->vc_count;
-                assert(global_ivc < total_vc);
-                assert(global_ovc_base < total_vc);
-
-                // Record ages.
-                assert(!queue_empty(ivc.buf));
-                age_vector[global_ivc] = queue_front(ivc.buf)->packet_id.id;
-
-                //
-                // Deadlock avoidance: Datelines.
-                //
-
-                // Dateline is between the router 3 and 0.
-                //
-                // If going to the same direction, only allocate VCs with the
-                // same number as IVC.  Whenever crossing the dateline,
-                // allocate VC with a higher number.
-                int vc_per_class = r->vc_count / r->vc_class_count;
-                int in_direction = (iport - 1) / 2;
-                int out_direction = (ivc.route_port - 1) / 2;
-                int ivc_class = ivc_num / vc_per_class;
-                int ovc_class =
-                    (iport != TERMINAL_PORT && in_direction == out_direction)
-                        ? ivc_class
-                        : 0;
-                int id_in_ring = torus_id_xyz_get(r->id.value, r->top_desc.k, out_direction);
-                if (r->vc_count > 1) {
-                    if ((id_in_ring == (r->top_desc.k - 1) &&
-                         ivc.route_port == get_output_port(out_direction, 1)) ||
-                        (id_in_ring == 0 &&
-                         ivc.route_port == get_output_port(out_direction, 0))) {
-                        // If going out to the same direction as coming in,
-                        // check that IVC was being maintained as 0.
-                        if (iport != TERMINAL_PORT &&
-                            in_direction == out_direction) {
-                            assert(ivc_class == 0);
-                        }
-                        ovc_class = 1;
-                        debugf(r, "VA: crossing dateline. Reallocating VC=%d->%d.\n", ivc_class, ovc_class);
-                    }
-                }
 
-                for (int i = 0; i < vc_per_class; i++) {
-                    int ovc_num = ovc_class * vc_per_class + i;
-                    request_vectors[alloc_vector_pos(
-                        total_vc, global_ivc,
-                        global_ovc_base + ovc_num)] = true;
-                    debugf(r,
-                           "VA: request from (iport=%d,VC=%d) -> "
-                           "(oport=%d,VC=%d)\n",
-                           iport, ivc_num, ivc.route_port, ovc_num);
-                }
-
-                // For non-torus topologies:
-                // for (int i = 0; i < r->vc_count; i++) {
-                //     request_vectors[alloc_vector_pos(total_vc, global_ivc,
-                //                                      global_ovc_base + i)] =
-                //     true;
-                // }
+        int ovc_base = vc_index(r, iv.route_port[ivc],
+                                msg_class * vc_per_msg +
+                                    ovc_class * vc_per_class);
+        int start = (r->va_last_grant_input[ivc] + 1) % total_vc;
+        int winner = -1, winner_dist = total_vc;
+        for (int i = 0; i < vc_per_class; i++) {
+            int ovc = ovc_base + i;
+            int dist = (ovc - start + total_vc) % total_vc;
+            if (dist < winner_dist) {
+                winner = ovc;
+                winner_dist = dist;
             }
+            debugf(r,
+                   "VA: request from (iport=%d,VC=%d) -> "
+                   "(oport=%d,VC=%d)\n",
+                   iport, ivc_num, iv.route_port[ivc], ovc % r->vc_count);
         }
-    }
-
-    // Step 1: Input arbitration from request vectors to x-vectors.
-    for (size_t global_ivc = 0; global_ivc < total_vc; global_ivc++) {
-        size_t winner = round_robin_arbitration(
-            total_vc, total_vc, global_ivc, true,
-            r->va_last_grant_input[global_ivc], request_vectors, x_vectors);
-        if (winner != static_cast<size_t>(-1)) {
-            r->va_last_grant_input[global_ivc] = (winner % total_vc);
+        if (winner < 0) {
+            continue;
         }
+        r->va_last_grant_input[ivc] = winner;
+        a.va_input_winner[ivc] = winner;
+
+        int ostart = (r->va_last_grant_output[winner] + 1) % total_vc;
+        int best = a.va_output_best[winner];
+        if (!bitmap_test(a.va_requested, winner) ||
+            (ivc - ostart + total_vc) % total_vc <
+                (best - ostart + total_vc) % total_vc) {
+            a.va_output_best[winner] = ivc;
+        }
+        bitmap_set(a.va_requested, winner);
     }
 
-    // Step 2: Output arbitration from x-vectors to grant vectors.
-    for (size_t global_ovc = 0; global_ovc < total_vc; global_ovc++) {
-        int oport = global_ovc / r->vc_count;
-        int ovc_num = global_ovc % r->vc_count;
-        OutputUnit::VC &ovc = r->output_units[oport].vcs[ovc_num];
-
-        // Only do arbitration for available output VCs.
-        if (ovc.global == STATE_IDLE) {
-            size_t winner = round_robin_arbitration(
-                total_vc, total_vc, global_ovc, false,
-                r->va_last_grant_output[global_ovc], x_vectors, grant_vectors);
-            // size_t winner = age_based_arbitration(
-            //     total_vc, total_vc, global_ovc, false,
-            //     r->va_last_grant_output[global_ovc], x_vectors, grant_vectors, age_vector);
-            if (winner != static_cast<size_t>(-1)) {
-                r->va_last_grant_output[global_ovc] = (winner / total_vc);
-            }
+    // Step 2: Output arbitration, only for the output VCs that are available.
+    for (int ovc = bitmap_next(a.va_requested, iv.words, 0); ovc >= 0;
+         ovc = bitmap_next(a.va_requested, iv.words, ovc + 1)) {
+        bitmap_clear(a.va_requested, ovc);
+        if (ov.global[ovc] == STATE_IDLE) {
+            int ivc = a.va_output_best[ovc];
+            r->va_last_grant_output[ovc] = ivc;
+            bitmap_set(a.grant_set, ivc);
         }
     }
 
     // Step 3: Update states for the granted VAs.
     int num_grant = 0;
-    for (size_t i = 0; i < vector_size; i++) {
-        if (grant_vectors[i]) {
-            size_t global_ivc = i / total_vc;
-            size_t global_ovc = i % total_vc;
-            int iport = global_ivc / r->vc_count;
-            int ivc_num = global_ivc % r->vc_count;
-            int oport = global_ovc / r->vc_count;
-            int ovc_num = global_ovc % r->vc_count;
-
-            InputUnit::VC &ivc = r->input_units[iport].vcs[ivc_num];
-            OutputUnit::VC &ovc = r->output_units[oport].vcs[ovc_num];
-
-            assert(ivc.global == STATE_VCWAIT);
-            assert(ovc.global == STATE_IDLE);
-            assert(ivc.route_port == oport);
+    for (int ivc = bitmap_next(a.grant_set, iv.words, 0); ivc >= 0;
+         ivc = bitmap_next(a.grant_set, iv.words, ivc + 1)) {
+        bitmap_clear(a.grant_set, ivc);
+        int iport = ivc / r->vc_count;
+        int ivc_num = ivc % r->vc_count;
+        int ovc = a.va_input_winner[ivc];
+        int oport = ovc / r->vc_count;
+        int ovc_num = ovc % r->vc_count;
+
+        assert(iv.global[ivc] == STATE_VCWAIT);
+        assert(ov.global[ovc] == STATE_IDLE);
+        assert(iv.route_port[ivc] == oport);
 
-            char s[IDSTRLEN];
-            debugf(r, "VA: success for %s from (iport=%d,VC=%d) to (oport=%d,VC=%d)\n",
-                   flit_str(queue_front(ivc.buf), s), iport, ivc_num, oport, ovc_num);
-
-            // We now have the VC, but we cannot proceed to the SA stage
-            // if there is no credit.
-            if (ovc.credit_count == 0) {
-                debugf(r, "VA: no credit, switching to CreditWait\n");
-                ivc.next_global = STATE_CREDWAIT;
-                ovc.next_global = STATE_CREDWAIT;
-            } else {
-                ivc.next_global = STATE_ACTIVE;
-                ovc.next_global = STATE_ACTIVE;
-            }
+        char s[IDSTRLEN];
+        debugf(r, "VA: success for %s from (iport=%d,VC=%d) to (oport=%d,VC=%d)\n",
+               flit_str(ivc_front(iv, ivc), s), iport, ivc_num, oport,
+               ovc_num);
+        trace_event(r, EV_VA, ivc_front(iv, ivc), oport, ovc_num);
+
+        // We now have the VC, but we cannot proceed to the SA stage
+        // if there is no credit.
+        if (ov.credit_count[ovc] == 0) {
+            debugf(r, "VA: no credit, switching to CreditWait\n");
+            r->stall_count[STALL_CREDIT]++;
+            ivc_set_next(iv, ivc, STATE_CREDWAIT);
+            ovc_set_next(ov, ovc, STATE_CREDWAIT);
+        } else {
+            ivc_set_next(iv, ivc, STATE_ACTIVE);
+            ovc_set_next(ov, ovc, STATE_ACTIVE);
+        }
 
-            // Record the VA result into the input/output units.
-            ivc.output_vc = ovc_num;
-            ovc.input_port = iport;
-            ovc.input_vc = ivc_num;
+        // Record the VA result into the input/output units.
+        iv.output_vc[ivc] = ovc_num;
+        ov.input_port[ovc] = iport;
+        ov.input_vc[ovc] = ivc_num;
 
-            ivc.stage = PIPELINE_SA;
-            r->reschedule_next_tick = true;
+        iv.stage[ivc] = PIPELINE_SA;
+        r->reschedule_next_tick = true;
 
-            num_grant++;
-        }
+        num_grant++;
     }
+    r->stall_count[STALL_VA] += num_req - num_grant;
 
     // debugf(r, "VA: granted to %d input VCs.\n", num_grant);
 }
@@ -1190,265 +1489,275 @@ void vc_alloc(Router *r)
 // Switch allocation.
 // Performs a (# of total input VCs) X (# radix) allocation.
 // This is because the switch has no output speedup.
+//
+// Separable (input-first) allocator with round-robin arbiters.  An input VC
+// only requests its route port, so the input arbitration always picks that;
+// the arbiter of each requested output port then picks input VCs from its
+// request bitmap, one for each lane of the output channel.
 void switch_alloc(Router *r)
 {
-    //
-    // Separable (input-first) allocator.
-    //
+    InputVCs &iv = r->ivcs;
+    OutputVCs &ov = r->ovcs;
+    Router::Allocator &a = r->alloc;
 
-    // FIXME: PERFORMANCE!
-
-    size_t total_vc = r->radix * r->vc_count;
-    size_t vector_size = total_vc * r->radix;
-    // Request vectors for each input VC. Has 1 request bit for each output VC.
-    std::vector<bool> request_vectors(vector_size, false);
-    // Age vector, for age-based arbitration.
-    std::vector<long> age_vector(total_vc, LONG_MAX);
-    // Input arbitration result vector, i.e. the 'x' vector in Figure 19.4.
-    std::vector<bool> x_vectors(vector_size, false);
-    // Grant vectors.
-    std::vector<bool> grant_vectors(vector_size, false);
-
-    // Step 0: Prepare request vectors.
-    for (int iport = 0; iport < r->radix; iport++) {
-        for (int ivc_num = 0; ivc_num < r->vc_count; ivc_num++) {
-            InputUnit::VC &ivc = r->input_units[iport].vcs[ivc_num];
-
-            if (ivc.stage == PIPELINE_SA && ivc.global == STATE_ACTIVE &&
-                !queue_empty(ivc.buf)) {
-                assert(ivc.route_port >= 0);
-                size_t global_ivc = iport * r->vc_count + ivc_num;
-                size_t oport = ivc.route_port;
-                assert(global_ivc < total_vc);
-
-                // Record ages.
-                age_vector[global_ivc] = queue_front(ivc.buf)->packet_id.id;
-
-                // Assert request for the routed oport.
-                // NOTE: No output speedup.
-                request_vectors[alloc_vector_pos(r->radix, global_ivc, oport)] =
-                    true;
-            }
-            // else if (ivc.stage == PIPELINE_SA &&
-            //            ivc.route_port == out_port &&
-            //            ivc.global == STATE_CREDWAIT) {
-            //     debugf(r, "Credit stall! port=%d\n", ivc->route_port);
-            // }
-        }
+    if (bitmap_next(iv.active_set, iv.words, 0) < 0) {
+        return;
     }
-
-    // Step 1: Input arbitration from request vectors to x-vectors.
-    for (size_t global_ivc = 0; global_ivc < total_vc; global_ivc++) {
-        size_t winner = round_robin_arbitration(
-            total_vc, r->radix, global_ivc, true,
-            r->sa_last_grant_input[global_ivc], request_vectors, x_vectors);
-        if (winner != static_cast<size_t>(-1)) {
-            r->sa_last_grant_input[global_ivc] = (winner % r->radix);
+    int total_vc = r->radix * r->vc_count;
+
+    // Steps 0 and 1: Requests and input arbitration.  Only the VCs in Active
+    // have requests.
+    int num_req = 0;
+    for (int ivc = bitmap_next(iv.active_set, iv.words, 0); ivc >= 0;
+         ivc = bitmap_next(iv.active_set, iv.words, ivc + 1)) {
+        assert(iv.global[ivc] == STATE_ACTIVE);
+        if (iv.stage[ivc] == PIPELINE_SA && !ivc_empty(iv, ivc)) {
+            assert(iv.route_port[ivc] >= 0);
+            num_req++;
+            // Assert request for the routed oport.
+            // NOTE: No output speedup.
+            int oport = iv.route_port[ivc];
+            r->sa_last_grant_input[ivc] = oport;
+            bitmap_set(&a.sa_requests[oport * iv.words], ivc);
+            bitmap_set(a.sa_requested, oport);
         }
     }
 
-    // Step 2: Output arbitration from x-vectors to grant vectors.
-    for (int oport = 0; oport < r->radix; oport++) {
+    // Step 2: Output arbitration.
+    for (int oport = bitmap_next(a.sa_requested, r->port_words, 0);
+         oport >= 0;
+         oport = bitmap_next(a.sa_requested, r->port_words, oport + 1)) {
+        bitmap_clear(a.sa_requested, oport);
+        uint64_t *requests = &a.sa_requests[oport * iv.words];
+
         // Unless all VCs of this oport is non-active, attempt to allocate on
         // this port.
         bool oport_has_active_vc = false;
         for (int ovc_num = 0; ovc_num < r->vc_count; ovc_num++) {
-            OutputUnit::VC &ovc = r->output_units[oport].vcs[ovc_num];
-            if (ovc.global == STATE_ACTIVE) {
+            int ovc = vc_index(r, oport, ovc_num);
+            if (ov.global[ovc] == STATE_ACTIVE) {
                 oport_has_active_vc = true;
             }
         }
 
         if (oport_has_active_vc) {
-            // First attempt the arbitration. Then, if the selected OVC is
-            // unfortunately the blocked one, disregard it.
-
-            size_t winner = round_robin_arbitration(
-                total_vc, r->radix, oport, false,
-                r->sa_last_grant_output[oport], x_vectors, grant_vectors);
-            // size_t winner = age_based_arbitration(
-            //     total_vc, r->radix, oport, false,
-            //     r->sa_last_grant_output[oport], x_vectors, grant_vectors, age_vector);
-            if (winner != static_cast<size_t>(-1)) {
-                // Now check if the selected OVC is fortunate.
-                assert(winner < vector_size);
-                size_t global_ivc = winner / r->radix;
-                int iport = global_ivc / r->vc_count;
-                int ivc_num = global_ivc % r->vc_count;
+            // A wide output channel can accept multiple flits per cycle, so
+            // repeat the output arbitration for each of its lanes, excluding
+            // the requests that already won.
+            int width = r->output_channels[oport]->width;
+            for (int lane = 0; lane < width; lane++) {
+                // First attempt the arbitration. Then, if the selected OVC is
+                // unfortunately the blocked one, disregard it.
+                int ivc = bitmap_next_wrap(
+                    requests, total_vc, r->sa_last_grant_output[oport] + 1);
+                if (ivc < 0) {
+                    break;
+                }
+                bitmap_clear(requests, ivc);
 
-                InputUnit::VC &ivc = r->input_units[iport].vcs[ivc_num];
-                assert(ivc.global == STATE_ACTIVE);
-                assert(ivc.output_vc >= 0);
-                OutputUnit::VC &ovc = r->output_units[oport].vcs[ivc.output_vc];
+                // Now check if the selected OVC is fortunate.
+                assert(iv.global[ivc] == STATE_ACTIVE);
+                assert(iv.output_vc[ivc] >= 0);
+                int ovc = vc_index(r, oport, iv.output_vc[ivc]);
 
                 // If unfortunate, the 'speculative' grant turned out to be
-                // a miss. Turn off the grant bit back to false.
-                if (ovc.global != STATE_ACTIVE) {
-                    grant_vectors[winner] = false;
+                // a miss.
+                if (ov.global[ovc] != STATE_ACTIVE) {
                     debugf(r, "SA: input arbitration picked a block OVC\n");
                 } else {
                     // FIXME: Should this be outside of this else?
-                    r->sa_last_grant_output[oport] = (winner / r->radix);
+                    r->sa_last_grant_output[oport] = ivc;
+                    bitmap_set(a.grant_set, ivc);
                 }
             }
         }
+        memset(requests, 0, iv.words * sizeof(uint64_t));
     }
 
     // Step 3: Update states for the granted SAs.
     int num_grant = 0;
-    for (size_t i = 0; i < vector_size; i++) {
-        if (grant_vectors[i]) {
-            size_t global_ivc = i / r->radix;
-            int oport = i % r->radix;
-            int iport = global_ivc / r->vc_count;
-            int ivc_num = global_ivc % r->vc_count;
-
-            // SA success!
-            InputUnit::VC &ivc = r->input_units[iport].vcs[ivc_num];
-            // ovc_num should be read from ivc.
-            OutputUnit::VC &ovc = r->output_units[oport].vcs[ivc.output_vc];
-
-            assert(ivc.global == STATE_ACTIVE);
-            assert(ovc.global == STATE_ACTIVE);
-            // Because sa_arbit_round_robin only selects input units that
-            // has flits in them, the input queue cannot be empty.
-            assert(!queue_empty(ivc.buf));
+    for (int ivc = bitmap_next(a.grant_set, iv.words, 0); ivc >= 0;
+         ivc = bitmap_next(a.grant_set, iv.words, ivc + 1)) {
+        bitmap_clear(a.grant_set, ivc);
+        int oport = iv.route_port[ivc];
+        int iport = ivc / r->vc_count;
+        int ivc_num = ivc % r->vc_count;
+
+        // SA success!
+        // ovc_num should be read from ivc.
+        int ovc = vc_index(r, oport, iv.output_vc[ivc]);
+
+        assert(iv.global[ivc] == STATE_ACTIVE);
+        assert(ov.global[ovc] == STATE_ACTIVE);
+        // Because only input VCs with flits request, the input queue cannot
+        // be empty.
+        assert(!ivc_empty(iv, ivc));
 
-            char s[IDSTRLEN];
-            debugf(r,
-                   "SA: success for %s from (iport=%d,VC=%d) to (oport = % d, "
-                   "VC = % d)\n",
-                   flit_str(queue_front(ivc.buf), s), iport, ivc_num, oport,
-                   ivc.output_vc);
-
-            // The flit leaves the input buffer here.
-            Flit *flit = queue_front(ivc.buf);
-            queue_pop(ivc.buf);
-            assert(!ivc.st_ready);
-            ivc.st_ready = flit;
-
-            // Credit decrement.
-            debugf(r, "Credit decrement, credit=%d->%d (oport=%d)\n",
-                   ovc.credit_count, ovc.credit_count - 1, oport);
-            assert(ovc.credit_count > 0);
-            ovc.credit_count--;
-
-            // SA -> ?? transition
-            //
-            // Set the next stage according to the flit type and credit
-            // count.
-            //
-            // Note that switching state to CreditWait does NOT prevent the
-            // subsequent ST to happen. The flit that has succeeded SA on
-            // this cycle is transferred to ivc.st_ready, and that is the
-            // only thing that is visible to the ST stage.
-            if (flit->type == FLIT_TAIL) {
-                ovc.next_global = STATE_IDLE;
-                if (queue_empty(ivc.buf)) {
-                    ivc.next_global = STATE_IDLE;
-                    ivc.stage = PIPELINE_IDLE;
-                    // debugf(this, "SA: next state is Idle\n");
-                } else {
-                    ivc.next_global = STATE_ROUTING;
-                    ivc.stage = PIPELINE_RC;
-                    // debugf(this, "SA: next state is Routing\n");
-                }
-                r->reschedule_next_tick = true;
-            } else if (ovc.credit_count == 0) {
-                // debugf(r, "SA: switching to CW\n");
-                ivc.next_global = STATE_CREDWAIT;
-                ovc.next_global = STATE_CREDWAIT;
-                // debugf(this, "SA: next state is CreditWait\n");
+        char s[IDSTRLEN];
+        debugf(r,
+               "SA: success for %s from (iport=%d,VC=%d) to (oport = % d, "
+               "VC = % d)\n",
+               flit_str(ivc_front(iv, ivc), s), iport, ivc_num, oport,
+               iv.output_vc[ivc]);
+
+        // The flit leaves the input buffer here.
+        Flit *flit = ivc_front(iv, ivc);
+        ivc_occupancy_update(iv, ivc, curr_time(r->eventq));
+        ivc_pop(iv, ivc);
+        assert(!iv.st_ready[ivc]);
+        iv.st_ready[ivc] = flit;
+        bitmap_set(iv.st_ready_set, ivc);
+        trace_event(r, EV_SA, flit, oport, iv.output_vc[ivc]);
+        // The flit traverses the switch in the next cycle.
+        r->reschedule_next_tick = true;
+
+        // Credit decrement.
+        debugf(r, "Credit decrement, credit=%d->%d (oport=%d)\n",
+               ov.credit_count[ovc], ov.credit_count[ovc] - 1, oport);
+        assert(ov.credit_count[ovc] > 0);
+        ov.credit_count[ovc]--;
+
+        // SA -> ?? transition
+        //
+        // Set the next stage according to the flit type and credit
+        // count.
+        //
+        // Note that switching state to CreditWait does NOT prevent the
+        // subsequent ST to happen. The flit that has succeeded SA on
+        // this cycle is transferred to iv.st_ready[ivc], and that is the
+        // only thing that is visible to the ST stage.
+        if (flit_is_tail(flit)) {
+            ovc_set_next(ov, ovc, STATE_IDLE);
+            if (ivc_empty(iv, ivc)) {
+                ivc_set_next(iv, ivc, STATE_IDLE);
+                iv.stage[ivc] = PIPELINE_IDLE;
+                // debugf(this, "SA: next state is Idle\n");
             } else {
-                ivc.next_global = STATE_ACTIVE;
-                ivc.stage = PIPELINE_SA;
-                // debugf(this, "SA: next state is Active\n");
-                r->reschedule_next_tick = true;
+                ivc_set_next(iv, ivc, STATE_ROUTING);
+                iv.stage[ivc] = PIPELINE_RC;
+                // debugf(this, "SA: next state is Routing\n");
             }
-            assert(ovc.credit_count >= 0);
-
-            num_grant++;
+            r->reschedule_next_tick = true;
+        } else if (ov.credit_count[ovc] == 0) {
+            // debugf(r, "SA: switching to CW\n");
+            r->stall_count[STALL_CREDIT]++;
+            ivc_set_next(iv, ivc, STATE_CREDWAIT);
+            ovc_set_next(ov, ovc, STATE_CREDWAIT);
+            // debugf(this, "SA: next state is CreditWait\n");
+        } else {
+            ivc_set_next(iv, ivc, STATE_ACTIVE);
+            iv.stage[ivc] = PIPELINE_SA;
+            // debugf(this, "SA: next state is Active\n");
+            r->reschedule_next_tick = true;
         }
+        assert(ov.credit_count[ovc] >= 0);
+
+        num_grant++;
+    }
+    r->stall_count[STALL_SA] += num_req - num_grant;
+}
+
+// CT stage: return a credit for the VCs 'vc_nums' of 'iport' to the upstream
+// node.
+static void switch_traverse_credit(Router *r, int iport,
+                                   const std::vector<long> &vc_nums)
+{
+    char s[IDSTRLEN], s2[IDSTRLEN];
+    Channel *ich = r->input_channels[iport];
+    // FIXME?
+    Credit *credit = new Credit{vc_nums};
+    channel_put_credit(ich, credit);
+    RouterPortPair credit_src_pair = ich->conn.src;
+    RouterPortPair credit_dst_pair = ich->conn.dst;
+    for (auto vc_num : vc_nums) {
+        trace_event(r, EV_CREDIT, NULL, iport, vc_num);
+        debugf(r, "Credit sent via VC%ld from {%s, %d} to {%s, %d}\n", vc_num,
+               id_str(credit_dst_pair.id, s), credit_dst_pair.port,
+               id_str(credit_src_pair.id, s2), credit_src_pair.port);
     }
 }
 
 void switch_traverse(Router *r)
 {
+    InputVCs &iv = r->ivcs;
     char s[IDSTRLEN], s2[IDSTRLEN], s3[IDSTRLEN];
 
-    for (int iport = 0; iport < r->radix; iport++) {
-        std::vector<long> vc_nums;
-        for (int ivc_num = 0; ivc_num < r->vc_count; ivc_num++) {
-            InputUnit::VC &ivc = r->input_units[iport].vcs[ivc_num];
-
-            if (ivc.st_ready) {
-                Flit *flit = ivc.st_ready;
-                ivc.st_ready = NULL;
-
-                // Caution: be sure to update the VC field in the flit.
-                assert(flit->vc_num == ivc_num);
-                flit->vc_num = ivc.output_vc;
-
-                // No output speedup: there is no need for an output buffer
-                // (Ch17.3).  Flits that exit the switch are directly placed on
-                // the channel.
-                Channel *och = r->output_channels[ivc.route_port];
-                channel_put(och, flit);
-                RouterPortPair src_pair = och->conn.src;
-                RouterPortPair dst_pair = och->conn.dst;
-
-                debugf(
-                    r,
-                    "ST: %s sent via VC%d from {%s, %d} to {%s, "
-                    "%d}\n",
-                    flit_str(flit, s), ivc.output_vc, id_str(src_pair.id, s2),
-                    src_pair.port, id_str(dst_pair.id, s3), dst_pair.port);
-
-                // With output speedup:
-                // auto &ou = output_units[ivc.route_port];
-                // ou->buf.push_back(flit);
-
-                vc_nums.push_back(ivc_num);
-            }
-        }
-
-        if (!vc_nums.empty()) {
-            // CT stage: return credit to the upstream node.
-            // Caution: do this once per input port.
-            Channel *ich = r->input_channels[iport];
-            // FIXME?
-            Credit *credit = new Credit{vc_nums};
-            channel_put_credit(ich, credit);
-            RouterPortPair credit_src_pair = ich->conn.src;
-            RouterPortPair credit_dst_pair = ich->conn.dst;
-            for (auto vc_num : vc_nums) {
-                debugf(r, "Credit sent via VC%d from {%s, %d} to {%s, %d}\n",
-                       vc_num, id_str(credit_dst_pair.id, s),
-                       credit_dst_pair.port, id_str(credit_src_pair.id, s2),
-                       credit_src_pair.port);
-            }
+    // Credits are returned once per input port, for all of its VCs that sent
+    // a flit.  The VCs of a port are adjacent in the bitmap.
+    std::vector<long> vc_nums;
+    int credit_port = -1;
+    for (int ivc = bitmap_next(iv.st_ready_set, iv.words, 0); ivc >= 0;
+         ivc = bitmap_next(iv.st_ready_set, iv.words, ivc + 1)) {
+        int iport = ivc / r->vc_count;
+        int ivc_num = ivc % r->vc_count;
+        if (iport != credit_port && !vc_nums.empty()) {
+            switch_traverse_credit(r, credit_port, vc_nums);
+            vc_nums.clear();
         }
+        credit_port = iport;
+
+        Flit *flit = iv.st_ready[ivc];
+        assert(flit);
+        iv.st_ready[ivc] = NULL;
+        bitmap_clear(iv.st_ready_set, ivc);
+
+        // Caution: be sure to update the VC field in the flit.
+        assert(flit->vc_num == ivc_num);
+        flit->vc_num = iv.output_vc[ivc];
+
+        // No output speedup: there is no need for an output buffer (Ch17.3).
+        // Flits that exit the switch are directly placed on the channel.
+        Channel *och = r->output_channels[iv.route_port[ivc]];
+        channel_put(och, flit);
+        trace_event(r, EV_ST, flit, iv.route_port[ivc], iv.output_vc[ivc]);
+        RouterPortPair src_pair = och->conn.src;
+        RouterPortPair dst_pair = och->conn.dst;
+
+        debugf(r, "ST: %s sent via VC%d from {%s, %d} to {%s, %d}\n",
+               flit_str(flit, s), iv.output_vc[ivc], id_str(src_pair.id, s2),
+               src_pair.port, id_str(dst_pair.id, s3), dst_pair.port);
+
+        // With output speedup:
+        // auto &ou = output_units[iv.route_port[ivc]];
+        // ou->buf.push_back(flit);
+
+        vc_nums.push_back(ivc_num);
+    }
+    if (!vc_nums.empty()) {
+        switch_traverse_credit(r, credit_port, vc_nums);
     }
 }
 
 void update_states(Router *r)
 {
+    InputVCs &iv = r->ivcs;
+    OutputVCs &ov = r->ovcs;
     int changed = 0;
-    for (int port = 0; port < r->radix; port++) {
-        for (int vc_num = 0; vc_num < r->vc_count; vc_num++) {
-            InputUnit::VC &ivc = r->input_units[port].vcs[vc_num];
-            OutputUnit::VC &ovc = r->output_units[port].vcs[vc_num];
-            if (ivc.global != ivc.next_global) {
-                ivc.global = ivc.next_global;
-                changed = 1;
+    for (int ivc = bitmap_next(iv.changed_set, iv.words, 0); ivc >= 0;
+         ivc = bitmap_next(iv.changed_set, iv.words, ivc + 1)) {
+        if (iv.global[ivc] != iv.next_global[ivc]) {
+            uint64_t *from = ivc_state_set(iv, iv.global[ivc]);
+            uint64_t *to = ivc_state_set(iv, iv.next_global[ivc]);
+            if (from) {
+                bitmap_clear(from, ivc);
             }
-            if (ovc.global != ovc.next_global) {
-                assert(!(ovc.next_global == STATE_CREDWAIT &&
-                         ovc.credit_count > 0));
-                ovc.global = ovc.next_global;
-                changed = 1;
+            if (to) {
+                bitmap_set(to, ivc);
             }
+            iv.global[ivc] = iv.next_global[ivc];
+            changed = 1;
+        }
+        bitmap_clear(iv.changed_set, ivc);
+    }
+    for (int ovc = bitmap_next(ov.changed_set, ov.words, 0); ovc >= 0;
+         ovc = bitmap_next(ov.changed_set, ov.words, ovc + 1)) {
+        if (ov.global[ovc] != ov.next_global[ovc]) {
+            assert(!(ov.next_global[ovc] == STATE_CREDWAIT &&
+                     ov.credit_count[ovc] > 0));
+            ov.global[ovc] = ov.next_global[ovc];
+            changed = 1;
         }
+        bitmap_clear(ov.changed_set, ovc);
     }
     // Reschedule whenever there is one or more state change.
     if (changed) r->reschedule_next_tick = true;
@@ -1456,48 +1765,48 @@ void update_states(Router *r)
 
 void router_print_state(Router *r)
 {
+    InputVCs &iv = r->ivcs;
+    OutputVCs &ov = r->ovcs;
     char s[IDSTRLEN];
     printf("[%s]\n", id_str(r->id, s));
 
     for (int i = 0; i < r->radix; i++) {
         for (int ivc_num = 0; ivc_num < r->vc_count; ivc_num++) {
-            InputUnit::VC &ivc = r->input_units[i].vcs[ivc_num];
-            if (ivc.route_port == -1 && ivc.output_vc == -1) {
+            int ivc = vc_index(r, i, ivc_num);
+            if (iv.route_port[ivc] == -1 && iv.output_vc[ivc] == -1) {
                 continue;
             }
             printf(" Input[%d,VC%d]: [%s] R=%2d, OVC=%2d {", i, ivc_num,
-                    globalstate_str(ivc.global, s), ivc.route_port,
-                    ivc.output_vc);
-            for (long i = queue_fronti(ivc.buf); i != queue_backi(ivc.buf);
-                 i = (i + 1) % queue_cap(ivc.buf)) {
-                Flit *flit = ivc.buf[i];
+                    globalstate_str(iv.global[ivc], s), iv.route_port[ivc],
+                    iv.output_vc[ivc]);
+            for (long i = 0; i < ivc_len(iv, ivc); i++) {
+                Flit *flit = iv.slab[ivc_slot(iv, ivc, i)];
                 printf("%s,", flit_str(flit, s));
             }
-            printf("} ST:%s\n", flit_str(ivc.st_ready, s));
+            printf("} ST:%s\n", flit_str(iv.st_ready[ivc], s));
         }
     }
 
     for (int i = 0; i < r->radix; i++) {
         for (int ovc_num = 0; ovc_num < r->vc_count; ovc_num++) {
-            OutputUnit::VC &ovc = r->output_units[i].vcs[ovc_num];
-            if (ovc.input_port == -1 && ovc.input_vc == -1) {
+            int ovc = vc_index(r, i, ovc_num);
+            if (ov.input_port[ovc] == -1 && ov.input_vc[ovc] == -1) {
                 continue;
             }
             printf("Output[%d,VC%d]: [%s] I=%2d, IVC=%2d, C=%2d\n", i, ovc_num,
-                    globalstate_str(ovc.global, s), ovc.input_port,
-                    ovc.input_vc, ovc.credit_count);
+                    globalstate_str(ov.global[ovc], s), ov.input_port[ovc],
+                    ov.input_vc[ovc], ov.credit_count[ovc]);
         }
     }
 
     for (int i = 0; i < r->radix; i++) {
         Channel *ch = r->input_channels[i];
-        if (queue_empty(ch->buf)) {
+        if (ring_empty(&ch->buf)) {
             continue;
         }
         printf("InChannel[%d]: {", i);
-        for (long i = queue_fronti(ch->buf); i != queue_backi(ch->buf);
-             i = (i + 1) % queue_cap(ch->buf)) {
-            TimedFlit tf = ch->buf[i];
+        for (size_t i = 0; i < ring_len(&ch->buf); i++) {
+            TimedFlit tf = ring_at(&ch->buf, i);
             printf("%ld:%s,", tf.time, flit_str(tf.flit, s));
         }
         printf("}\n");
@@ -3,10 +3,15 @@
 
 #include "event.h"
 #include "stb_ds.h"
+#include "queue.h"
+#include "hist.h"
+#include "rng.h"
+#include "arena.h"
 #include <vector>
 #include <map>
 #include <random>
-#include <deque>
+#include <climits>
+#include <algorithm>
 
 // Port that is always connected to a terminal.
 #define TERMINAL_PORT 0
@@ -18,6 +23,8 @@
 #define NORMALLEN 128
 // Excess storage in channel to prevent overrun.
 #define CHANNEL_SLACK 4
+// Initial capacity of the source queues, in packets.  They grow as needed.
+#define SOURCE_QUEUE_INIT_CAP 16
 
 // ID of the source node is encoded into PacketId.
 struct PacketId {
@@ -33,6 +40,15 @@ inline bool operator<(const PacketId &a, const PacketId &b)
 struct PacketTimestamp {
     long gen; // cycle # that the packet was generated
     long arr; // cycle # that the whole packet arrived
+    long len; // length of the packet in flits
+    bool tagged; // generated within the measurement window
+    long inj; // cycle # that the head flit left the source
+};
+
+// Latency statistics of the packets of a single length.
+struct SizeStat {
+    long latency_sum = 0;
+    long packet_arrive_count = 0;
 };
 
 struct Stat {
@@ -40,25 +56,60 @@ struct Stat {
     std::map<PacketId, PacketTimestamp> packet_ledger;
     long latency_sum = 0;
     long packet_gen_count = 0;
-    long packet_arrive_count = 0;
+    long flit_gen_count = 0;
+    long packet_arrive_count = 0; // tagged packets only
     long hop_count_sum = 0;
+    std::map<long, SizeStat> size_stats; // keyed by packet length
+    long rtt_sum = 0; // round-trip latency of request/reply pairs
+    long reply_arrive_count = 0;
+    // Measurement window [measure_start, measure_end).  Packets generated
+    // within it are tagged, and only those count toward latency statistics.
+    long measure_start = 0;
+    long measure_end = LONG_MAX;
+    long tagged_gen_count = 0;
+    long window_flit_gen_count = 0;    // flits generated within the window
+    long window_flit_arrive_count = 0; // flits arrived within the window
+    // Latency distributions of the tagged packets.
+    Hist packet_hist = {};   // generation to arrival
+    Hist network_hist = {};  // injection to arrival
+    Hist queueing_hist = {}; // generation to injection
+    // Packet latency per source/destination pair, indexed by
+    // src * pair_hist_nodes + dst.  Allocated on first use; empty if
+    // pair_hist_nodes is 0.
+    int pair_hist_nodes = 0;
+    std::vector<Hist *> pair_hists;
 };
 
+static inline bool stat_in_window(const Stat *stat, long t)
+{
+    return stat->measure_start <= t && t < stat->measure_end;
+}
+
 typedef struct RouterPortPair {
     Id id;
     int port;
 } RouterPortPair;
 
+// Physical properties of a link.
+typedef struct LinkDesc {
+    long delay; // latency in cycles
+    int width;  // number of flits that can be put on the link in a cycle
+} LinkDesc;
+
+static const LinkDesc default_link = {.delay = 1, .width = 1};
+
 typedef struct Connection {
     RouterPortPair src;
     RouterPortPair dst;
     int uniq; // used as hash key
+    LinkDesc link;
 } Connection;
 
 static const Connection not_connected = {
     .src = (RouterPortPair){.id = {ID_RTR, -1}, .port = -1},
     .dst = (RouterPortPair){.id = {ID_RTR, -1}, .port = -1},
     .uniq = -1,
+    .link = {.delay = -1, .width = 0},
 };
 
 void print_conn(const char *name, Connection conn);
@@ -93,7 +144,11 @@ int get_output_port(int direction, int to_larger);
 int torus_id_xyz_get(int id, int k, int direction);
 int torus_id_xyz_set(int id, int k, int direction, int component);
 int torus_align_id(int k, int src_id, int dst_id, int move_direction);
-Topology topology_torus(int k, int r);
+std::vector<int> torus_morton_order(int k, int r);
+Topology topology_torus(int k, int r, LinkDesc term_link,
+                        const LinkDesc *dim_links);
+int topology_set_link(Topology *t, RouterPortPair out_port, LinkDesc link);
+long topology_min_delay(const Topology *t);
 void topology_destroy(Topology *top);
 
 Connection conn_find_forward(Topology *t, RouterPortPair out_port);
@@ -102,6 +157,15 @@ Connection conn_find_reverse(Topology *t, RouterPortPair in_port);
 enum TrafficType {
     TRF_UNIFORM_RANDOM,
     TRF_DESIGNATED,
+    TRF_TRANSPOSE,
+    TRF_BIT_COMPLEMENT,
+    TRF_BIT_REVERSE,
+    TRF_SHUFFLE,
+    TRF_TORNADO,
+    TRF_NEIGHBOR,
+    TRF_HOTSPOT,
+    TRF_RANDOM_PERMUTATION,
+    TRF_COUNT,
 };
 
 struct TrafficDesc {
@@ -111,12 +175,99 @@ struct TrafficDesc {
 
     TrafficType type; // traffic type
     std::vector<int> dests;       // destination table
+    std::vector<int> hotspots;    // hotspot node IDs, for TRF_HOTSPOT
+    double hotspot_rate = 0.0;    // fraction of packets sent to hotspots
+};
+
+struct RandomGenerator;
+
+const char *traffic_str(TrafficType type);
+int traffic_type_from_str(const char *s, TrafficType *type);
+TrafficDesc traffic_create(TrafficType type, TopoDesc td, int terminal_count,
+                           uint64_t seed);
+TrafficDesc traffic_hotspot(int terminal_count, std::vector<int> hotspots,
+                            double hotspot_rate);
+int traffic_dest(const TrafficDesc &trd, int src, RandomGenerator &rg);
+
+// Temporal injection process of each source node.
+enum InjectionType {
+    INJ_POISSON,
+    INJ_BERNOULLI,
+    INJ_ONOFF,
+    INJ_MMPP,
+    INJ_COUNT,
+};
+
+// Maximum number of states of a Markov-modulated process.
+#define MMPP_MAX_STATES 8
+
+// Bernoulli and on/off processes are expressed as Markov-modulated Bernoulli
+// processes: in state i, a packet is injected with probability inject_prob[i]
+// each cycle, and the process moves on to state (i + 1) % state_count with
+// probability leave_prob[i] each cycle.
+struct InjectionDesc {
+    InjectionType type = INJ_POISSON;
+    double mean_interval = 0.0; // for INJ_POISSON, in cycles
+    int state_count = 1;
+    double rate[MMPP_MAX_STATES] = {0};  // offered flits/cycle in each state
+    double dwell[MMPP_MAX_STATES] = {0}; // mean cycles in each state, 0: forever
+    double inject_prob[MMPP_MAX_STATES] = {0}; // set by injection_setup()
+    double leave_prob[MMPP_MAX_STATES] = {0};  // set by injection_setup()
+    int gen_width = 1; // flits generated per cycle, the terminal link width
+};
+
+struct PacketLenDesc;
+
+const char *injection_str(InjectionType type);
+int injection_type_from_str(const char *s, InjectionType *type);
+InjectionDesc injection_poisson(double mean_interval);
+InjectionDesc injection_poisson_rate(double rate);
+InjectionDesc injection_bernoulli(double rate);
+InjectionDesc injection_onoff(double rate, double burst);
+InjectionDesc injection_mmpp(int state_count, const double *rates,
+                             const double *dwells);
+void injection_setup(InjectionDesc *inj, const PacketLenDesc &pl);
+int injection_initial_state(const InjectionDesc &inj, RandomGenerator &rg);
+long injection_next_arrival(const InjectionDesc &inj, long last, int *state,
+                            RandomGenerator &rg);
+
+// Distribution of packet lengths.  A fixed length, bimodal request/response
+// lengths and empirical histograms are all tables of lengths and weights.
+enum PacketLenType {
+    PLEN_FIXED,
+    PLEN_BIMODAL,
+    PLEN_HISTOGRAM,
+};
+
+struct PacketLenDesc {
+    PacketLenType type = PLEN_FIXED;
+    std::vector<long> lens;     // possible lengths in flits
+    std::vector<double> weights; // relative frequency of each length
+    std::discrete_distribution<int> pick; // index into 'lens'
+};
+
+PacketLenDesc packet_len_fixed(long len);
+PacketLenDesc packet_len_bimodal(long short_len, long long_len,
+                                 double short_frac);
+PacketLenDesc packet_len_histogram(std::vector<long> lens,
+                                   std::vector<double> weights);
+PacketLenDesc packet_len_from_file(const char *path);
+double packet_len_mean(const PacketLenDesc &pl);
+long packet_len_sample(PacketLenDesc &pl, RandomGenerator &rg);
+
+// Message classes of the request/reply protocol.  Each class uses a disjoint
+// set of VCs so that replies never wait behind requests (protocol deadlock).
+enum MsgClass {
+    MSG_REQUEST,
+    MSG_REPLY,
+    MSG_CLASS_COUNT,
 };
 
 enum FlitType {
     FLIT_HEAD,
     FLIT_BODY,
     FLIT_TAIL,
+    FLIT_HEADTAIL, // single-flit packet
 };
 
 typedef struct RouteInfo {
@@ -136,10 +287,74 @@ struct Flit {
     RouteInfo route_info;
     PacketId packet_id;
     long flitnum;
+    int msg_class = MSG_REQUEST;
+    long req_time = -1; // for replies, generation time of the request
 };
 
+static inline bool flit_is_head(const Flit *flit)
+{
+    return flit->type == FLIT_HEAD || flit->type == FLIT_HEADTAIL;
+}
+
+static inline bool flit_is_tail(const Flit *flit)
+{
+    return flit->type == FLIT_TAIL || flit->type == FLIT_HEADTAIL;
+}
+
 char *flit_str(const Flit *flit, char *s);
 
+// A packet waiting in a source queue.  Its flits are only materialized as
+// they are sent, so that a backlogged source holds one of these per packet
+// instead of a Flit per flit.
+//
+// Requests are generated 'width' flits per cycle from 'head_time' on, which
+// the flits sent may not outrun; replies are generated whole.  Rather than
+// ticking the source for each flit, the flits generated by a cycle are worked
+// out with source_packet_generated().
+struct SourcePacket {
+    long id;             // packet ID at the source
+    long req_time;       // for replies, generation time of the request
+    long len;            // length in flits
+    long head_time;      // cycle the head flit is generated
+    long sent;           // # of flits sent so far
+    int dest;            // destination node ID
+    long width;          // flits generated per cycle, 'len' for replies
+    uint32_t route_dice; // random choices of the route, see source_route_dice()
+};
+
+// Number of cycles it takes to generate all flits of 'p'.
+static inline long source_packet_gen_cycles(const SourcePacket &p)
+{
+    return (p.len + p.width - 1) / p.width;
+}
+
+// Number of flits of 'p' generated by cycle 'now'.
+static inline long source_packet_generated(const SourcePacket &p, long now)
+{
+    if (now < p.head_time) {
+        return 0;
+    }
+    long cycles = now - p.head_time + 1;
+    return cycles >= source_packet_gen_cycles(p) ? p.len : cycles * p.width;
+}
+
+// Cycle that flit 'i' of 'p' is generated in.
+static inline long source_packet_flit_time(const SourcePacket &p, long i)
+{
+    return p.head_time + i / p.width;
+}
+
+// Number of flits of 'p' generated in the cycles [from, to).
+static inline long source_packet_generated_between(const SourcePacket &p,
+                                                   long from, long to)
+{
+    if (from >= to) {
+        return 0;
+    }
+    return source_packet_generated(p, to - 1) -
+           source_packet_generated(p, from - 1);
+}
+
 struct Credit {
     Credit() {}
     Credit(const std::vector<long> &vc_nums) : vc_nums(vc_nums) {}
@@ -161,18 +376,24 @@ typedef struct TimedCredit {
 } TimedCredit;
 
 struct Channel {
-    Channel(EventQueue *eq, long dl, const Connection conn);
+    Channel(EventQueue *eq, const Connection conn);
     ~Channel();
 
     Connection conn;
     EventQueue *eventq;
     long delay;
-    TimedFlit *buf = NULL;
-    std::deque<TimedCredit> buf_credit;
+    int width;               // max # of flits put in a single cycle
+    long last_put_time = -1; // cycle of the last channel_put
+    int put_count = 0;       // # of flits put in last_put_time
+    Ring<TimedFlit> buf;          // flits in flight, fixed capacity
+    Ring<TimedCredit> buf_credit; // credits in flight, growable
     long load_count = 0; // total number of flits put on this channel.
+    // Nodes at both ends, woken up on arrivals.  NULL if not attached, in
+    // which case the ends are ticked on every arrival.
+    Router *src_node = NULL;
+    Router *dst_node = NULL;
 };
 
-Channel channel_create(EventQueue *eq, long dl, const Connection conn);
 void channel_put(Channel *ch, Flit *flit);
 void channel_put_credit(Channel *ch, Credit *credit);
 Flit *channel_get(Channel *ch);
@@ -180,7 +401,7 @@ Credit *channel_get_credit(Channel *ch);
 void channel_destroy(Channel *ch);
 
 // Pipeline stages.
-enum PipelineStage {
+enum PipelineStage : uint8_t {
     PIPELINE_IDLE,
     PIPELINE_RC,
     PIPELINE_VA,
@@ -189,7 +410,7 @@ enum PipelineStage {
 };
 
 // Global states of each input/output unit.
-enum GlobalState {
+enum GlobalState : uint8_t {
     STATE_IDLE,
     STATE_ROUTING,
     STATE_VCWAIT,
@@ -199,120 +420,334 @@ enum GlobalState {
 
 char *globalstate_str(enum GlobalState state, char *s);
 
-// credit_count is omitted in the input unit; it can be found in the output unit
+// Bitmaps over the VCs of a router, in 64-bit words.
+static inline int bitmap_words(int n)
+{
+    return (n + 63) / 64;
+}
+
+static inline void bitmap_set(uint64_t *bm, int i)
+{
+    bm[i / 64] |= 1ull << (i % 64);
+}
+
+static inline void bitmap_clear(uint64_t *bm, int i)
+{
+    bm[i / 64] &= ~(1ull << (i % 64));
+}
+
+static inline bool bitmap_test(const uint64_t *bm, int i)
+{
+    return (bm[i / 64] >> (i % 64)) & 1;
+}
+
+// Index of the first set bit at or after 'i', or -1 if there is none.
+// Iterating with bitmap_next(bm, words, ivc + 1) sees bits changed behind the
+// cursor only.
+static inline int bitmap_next(const uint64_t *bm, int words, int i)
+{
+    int w = i / 64;
+    if (w >= words) {
+        return -1;
+    }
+    uint64_t bits = bm[w] & (~0ull << (i % 64));
+    while (!bits) {
+        if (++w == words) {
+            return -1;
+        }
+        bits = bm[w];
+    }
+    return w * 64 + __builtin_ctzll(bits);
+}
+
+// Index of the first set bit at or after 'i', wrapping around to bit 0 at
+// the end of the 'n' bits, or -1 if there is none.  This is the winner of a
+// round-robin arbitration whose pointer is at 'i'.
+static inline int bitmap_next_wrap(const uint64_t *bm, int n, int i)
+{
+    int words = bitmap_words(n);
+    int j = (i < n) ? bitmap_next(bm, words, i) : -1;
+    return (j >= 0) ? j : bitmap_next(bm, words, 0);
+}
+
+// State of all input VCs of a router, laid out as structure-of-arrays so that
+// the pipeline stages scan contiguous memory.  Arrays are indexed by
+// 'port * vc_count + vc' (see vc_index()).  The flit buffers of the VCs are
+// rings of 'buf_cap' flits each, carved out of a single slab with a
+// power-of-two stride so that slots wrap with a mask.  All arrays are
+// allocated from the arena of the simulation, next to the router.
+//
+// The pipeline stages only visit the VCs in the bitmaps that concern them, so
+// that the cost of a tick follows the activity of the router rather than its
+// size.  The state bitmaps follow 'global' and are only updated in
+// update_states(); writes to 'next_global' go through ivc_set_next().
+//
+// credit_count is omitted in the input VCs; it can be found in the output VCs
 // instead.
-struct InputUnit {
-    InputUnit(int vc_count, int bufsize);
-
-    struct VC {
-        VC(int bufsize);
-        ~VC();
-
-        enum GlobalState global = STATE_IDLE;
-        enum GlobalState next_global = STATE_IDLE;
-        int route_port = -1;
-        int output_vc = -1;
-        enum PipelineStage stage = PIPELINE_IDLE;
-        Flit **buf = NULL;
-        Flit *st_ready = NULL;
-    };
-    std::vector<VC> vcs;
+struct InputVCs {
+    int count;    // # of input VCs
+    int words;    // # of words of each bitmap
+    long buf_cap;  // flits per VC buffer
+    int buf_shift; // log2 of the slots per VC ring, >= buf_cap
+    GlobalState *global;
+    GlobalState *next_global;
+    PipelineStage *stage;
+    int *route_port;
+    int *output_vc;
+    long *buf_front; // slot of the front flit, masked
+    long *buf_len;   // # of flits in the buffer
+    Flit **slab;     // all VC rings, 1 << buf_shift slots each
+    Flit **st_ready;
+    long *occ_area;  // integral of the buffer length over time
+    long *occ_time;  // cycle 'occ_area' is accounted up to
+    uint64_t *routing_set;  // global is Routing
+    uint64_t *vcwait_set;   // global is VCWait
+    uint64_t *active_set;   // global is Active
+    uint64_t *st_ready_set; // st_ready is not NULL
+    uint64_t *changed_set;  // next_global written this cycle
 };
 
-struct OutputUnit {
-    OutputUnit(int vc_count, int bufsize);
-
-    struct VC {
-        VC(int bufsize);
-        ~VC();
-
-        enum GlobalState global = STATE_IDLE;
-        enum GlobalState next_global = STATE_IDLE;
-        int input_port = -1;
-        int input_vc = -1;
-        int credit_count;
-        bool buf_credit = false;
-    };
-    std::vector<VC> vcs;
+void input_vcs_init(InputVCs *iv, Arena *a, int count, long buf_cap);
+
+// Bitmap of the input VCs in 'state', or NULL if it is not tracked.
+static inline uint64_t *ivc_state_set(InputVCs &iv, GlobalState state)
+{
+    switch (state) {
+    case STATE_ROUTING:
+        return iv.routing_set;
+    case STATE_VCWAIT:
+        return iv.vcwait_set;
+    case STATE_ACTIVE:
+        return iv.active_set;
+    default:
+        return NULL;
+    }
+}
+
+static inline void ivc_set_next(InputVCs &iv, int ivc, GlobalState state)
+{
+    iv.next_global[ivc] = state;
+    bitmap_set(iv.changed_set, ivc);
+}
+
+static inline long ivc_len(const InputVCs &iv, int ivc)
+{
+    return iv.buf_len[ivc];
+}
+
+static inline bool ivc_empty(const InputVCs &iv, int ivc)
+{
+    return iv.buf_len[ivc] == 0;
+}
+
+static inline bool ivc_full(const InputVCs &iv, int ivc)
+{
+    return iv.buf_len[ivc] == iv.buf_cap;
+}
+
+// Slab index of the i-th flit from the front of 'ivc'.
+static inline long ivc_slot(const InputVCs &iv, int ivc, long i)
+{
+    long mask = (1l << iv.buf_shift) - 1;
+    return (static_cast<long>(ivc) << iv.buf_shift) +
+           ((iv.buf_front[ivc] + i) & mask);
+}
+
+static inline Flit *ivc_front(const InputVCs &iv, int ivc)
+{
+    return iv.slab[ivc_slot(iv, ivc, 0)];
+}
+
+static inline void ivc_put(InputVCs &iv, int ivc, Flit *flit)
+{
+    iv.slab[ivc_slot(iv, ivc, iv.buf_len[ivc])] = flit;
+    iv.buf_len[ivc]++;
+}
+
+static inline Flit *ivc_pop(InputVCs &iv, int ivc)
+{
+    Flit *flit = ivc_front(iv, ivc);
+    iv.buf_front[ivc] = (iv.buf_front[ivc] + 1) & ((1l << iv.buf_shift) - 1);
+    iv.buf_len[ivc]--;
+    return flit;
+}
+
+// Account the occupancy of 'ivc' up to 'now'.  Call before every change of
+// its buffer length.
+static inline void ivc_occupancy_update(InputVCs &iv, int ivc, long now)
+{
+    iv.occ_area[ivc] += iv.buf_len[ivc] * (now - iv.occ_time[ivc]);
+    iv.occ_time[ivc] = now;
+}
+
+// Reasons an input VC fails to advance in a cycle.
+enum StallKind {
+    STALL_VA,     // lost VC allocation, or no free output VC
+    STALL_SA,     // lost switch allocation
+    STALL_CREDIT, // waiting for a downstream credit
+    STALL_KIND_COUNT,
+};
+
+// State of all output VCs of a router, indexed like InputVCs.
+struct OutputVCs {
+    int count; // # of output VCs
+    int words; // # of words of each bitmap
+    GlobalState *global;
+    GlobalState *next_global;
+    int *input_port;
+    int *input_vc;
+    int *credit_count;
+    uint64_t *credit_set;  // a credit has arrived
+    uint64_t *changed_set; // next_global written this cycle
 };
 
+void output_vcs_init(OutputVCs *ov, Arena *a, int count, int credit_count);
+
+static inline void ovc_set_next(OutputVCs &ov, int ovc, GlobalState state)
+{
+    ov.next_global[ovc] = state;
+    bitmap_set(ov.changed_set, ovc);
+}
+
 Event tick_event_from_id(Id id);
 
+// Debug logging of router events, enabled at runtime with -v.
+//
+// debugf() is a macro so that its arguments, e.g. flit_str() calls, are only
+// evaluated when the router is verbose.  With NETSIM_NO_DEBUG_LOG (release
+// builds) the calls compile to nothing, but are still type-checked.
+#ifdef NETSIM_NO_DEBUG_LOG
+#define DEBUG_LOG_ENABLED 0
+#else
+#define DEBUG_LOG_ENABLED 1
+#endif
+#define debugf(r, ...)                                                         \
+    do {                                                                       \
+        if (DEBUG_LOG_ENABLED && (r)->verbose)                                 \
+            debugf_impl((r), __VA_ARGS__);                                     \
+    } while (0)
+void debugf_impl(Router *r, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// Stream numbers of the node RNGs, and of the other users of the seed.
+static inline uint64_t rng_stream(Id id)
+{
+    return (static_cast<uint64_t>(id.type) << 32) |
+           static_cast<uint32_t>(id.value);
+}
+#define RNG_STREAM_TRAFFIC UINT64_MAX
+
+// Random number streams of a single node.  Every router, source and
+// destination node draws from its own Philox stream, numbered by
+// rng_stream(), so that the results depend on the seed only.
 struct RandomGenerator {
-    RandomGenerator(int terminal_count, double mean_interval);
+    RandomGenerator(uint64_t seed, int terminal_count, double mean_interval);
 
-    std::default_random_engine def;
-    std::random_device rd;
+    Philox rng;
     std::uniform_int_distribution<int> uni_dist;
+    std::uniform_int_distribution<int> uni_dist_others; // excludes one node
+    std::uniform_real_distribution<> unit_dist;
     std::exponential_distribution<> exp_dist;
 };
 
 /// A router. It can represent any of a switch node, a source node and a
 /// destination node.
+///
+/// Routers are placed in the arena of the simulation, each followed by its
+/// per-port and per-VC arrays, which are allocated from 'arena' by the
+/// constructor.  'in_chs' and 'out_chs' hold 'radix' channels each, or are
+/// NULL if the node has no input or output channels.
 struct Sim;
 struct Router {
-    Router(Sim &sim, EventQueue *eq, Stat *st, bool verbose, Id id, int radix,
-           int vc_count, TopoDesc td, TrafficDesc trd, RandomGenerator &rg,
-           long packet_len, Channel **in_chs, Channel **out_chs,
+    Router(Sim &sim, Arena *arena, EventQueue *eq, Stat *st, bool verbose,
+           Id id, int radix, int vc_count, TopoDesc td,
+           const TrafficDesc &trd, const RandomGenerator &rg,
+           Channel *const *in_chs, Channel *const *out_chs,
            long input_buf_size);
     ~Router();
 
-    template <typename T> T &get_device() const;
-
     Sim &sim;           // FIXME: not pretty
     EventQueue *eventq; // reference to the simulator-global event queue
     Stat *stat;
     bool verbose;
-    bool deterministic = true;
     Id id;                      // router ID
     int radix;                  // radix
     int vc_count;               // number of VCs per channel
     int vc_class_count;         // number of VC class for deadlock avoidance
+    int msg_class_count;        // number of message classes, each with
+                                // vc_class_count VC classes
     long flit_arrive_count = 0; // # of flits arrived for the destination node
     long flit_depart_count = 0; // # of flits departed for the destination node
     TopoDesc top_desc;
-    TrafficDesc traffic_desc;
-    RandomGenerator &rand_gen;
+    const TrafficDesc &traffic_desc;
+    RandomGenerator rand_gen; // own stream of this node
     long last_tick = -1; // prevents double-tick in a cycle
-    long packet_len;     // length of a packet in flits
+    long stall_count[STALL_KIND_COUNT] = {}; // allocation stalls by kind
     bool reschedule_next_tick =
         false; // marks whether to self-tick at the next cycle
+    long wake_time = -1; // cycle of the last tick scheduled, see router_wake()
     struct SourceGenInfo {
         double mean_interval = 1.0;
-        bool packet_finished = true;
-        long next_packet_start = 0;
-        double next_packet_start_frac = 0.0;
+        long next_packet_start = 0; // arrival time of the next packet
+        long gen_free = 0;   // cycle the last packet is done generating
+        long gen_wake = -1;  // cycle of the pending generation tick
         long packet_counter = 0;
-        long flitnum = 0; // n-th flit counter of a packet
+        int inj_state = -1;  // state of the injection process, -1: unset
+        int outstanding = 0; // # of requests waiting for reply
     } sg;
-    Channel **input_channels;             // accessor to the input channels
-    Channel **output_channels;            // accessor to the output channels
+    Channel **input_channels;             // [radix], NULL if not connected
+    Channel **output_channels;            // [radix], NULL if not connected
+    int port_words;                       // # of words of a port bitmap
+    uint64_t *flit_pending;   // input ports with flits in the channel
+    uint64_t *credit_pending; // output ports with credits in the channel
     long input_buf_size;                  // max size of each input flit queue
-    Flit **source_queue;                  // source queue
-    std::vector<InputUnit> input_units;   // input units
-    std::vector<OutputUnit> output_units; // output units
+    Ring<SourcePacket> source_queue;      // source queue, growable
+    Ring<SourcePacket> reply_queue;       // source queue for replies
+    InputVCs ivcs;                        // input VCs of all ports
+    OutputVCs ovcs;                       // output VCs of all ports
+    // Scratch state of the VC and switch allocators.  Kept across ticks so
+    // that the allocators do not allocate; each one leaves it cleared.
     struct Allocator {
+        int *va_input_winner; // [vc] output VC picked by input arbitration
+        int *va_output_best;  // [vc] best input VC so far for each output VC
+        uint64_t *va_requested; // output VCs picked by an input VC
+        uint64_t *grant_set;    // input VCs granted in this allocation
+        uint64_t *sa_requests;  // [radix][words] input VCs for each oport
+        uint64_t *sa_requested; // output ports with a request
     } alloc;
-    int src_last_grant_output; // for round-robin arbitration
+    int src_last_grant_output[MSG_CLASS_COUNT]; // for round-robin arbitration,
+                                                // for each message class
     int dst_last_grant_input; // for round-robin arbitration
-    std::vector<int>
-        va_last_grant_input; // for round-robin arbitration, for each input VC
-    std::vector<int>
-        va_last_grant_output; // for round-robin arbitration, for each output VC
-    std::vector<int>
-        sa_last_grant_input; // for round-robin arbitration, for each input VC
-    std::vector<int>
-        sa_last_grant_output; // for round-robin arbitration, for each output VC
+    // For round-robin arbitration, for each input/output VC, and for each
+    // output port.
+    int *va_last_grant_input;
+    int *va_last_grant_output;
+    int *sa_last_grant_input;
+    int *sa_last_grant_output;
 };
 
+// Index of VC 'vc' of 'port' into the InputVCs and OutputVCs arrays.
+static inline int vc_index(const Router *r, int port, int vc)
+{
+    return port * r->vc_count + vc;
+}
+
+size_t router_arena_size(int radix, int vc_count, long input_buf_size);
 void router_print_state(Router *r);
+void router_set_msg_classes(Router *r, int msg_class_count);
 
 // Events and scheduling.
 void router_tick(Router *r);
+void router_wake(Router *r, long when);
 void router_reschedule(Router *r);
 
 // Routing.
-std::vector<int> source_route_compute(TopoDesc td, int src_id, int dst_id);
+uint32_t source_route_dice(Router *r, TopoDesc td, int src_id, int dst_id);
+std::vector<int> source_route_path(TopoDesc td, int src_id, int dst_id,
+                                   uint32_t dice);
+int source_route_hops(TopoDesc td, int src_id, int dst_id);
+std::vector<int> source_route_compute(Router *r, TopoDesc td, int src_id,
+                                      int dst_id);
 
 // Pipeline stages.
 void source_generate(Router *r);
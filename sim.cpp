@@ -1,28 +1,48 @@
 #include "sim.h"
 #include <stdio.h>
+#include <stdarg.h>
 #include <assert.h>
+#include <climits>
+#include <algorithm>
+#include <cmath>
+#include <new>
 
 void print_conn(const char *name, Connection conn);
 
-Sim::Sim(bool verbose_mode, int debug_mode, Topology top, int terminal_count,
-         int router_count, int radix, int vc_count, double mean_interval, long input_buf_size)
-    : debug_mode(debug_mode), topology(top), traffic_desc(terminal_count),
-      rand_gen(terminal_count, mean_interval)
+static Channel *channel_find(ChannelMap *map, Connection conn)
 {
-    // Tornado pattern for 4-ring
-    // traffic_desc = {TRF_DESIGNATED, std::vector<int>(terminal_count)};
-    // traffic_desc.dests[0] = 2;
-    // traffic_desc.dests[1] = 3;
-    // traffic_desc.dests[2] = 0;
-    // traffic_desc.dests[3] = 1;
+    long idx = hmgeti(map, conn.uniq);
+    assert(idx >= 0);
+    return map[idx].value;
+}
 
+void fatal(const char *fmt, ...)
+{
+    va_list args;
+    fprintf(stderr, "fatal: ");
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    exit(EXIT_FAILURE);
+}
+
+Sim::Sim(bool verbose_mode, int debug_mode, Topology top, int terminal_count,
+         int router_count, int radix, int vc_count, TrafficDesc trd,
+         InjectionDesc inj, PacketLenDesc pld, long input_buf_size,
+         uint64_t seed)
+    : debug_mode(debug_mode), topology(top), traffic_desc(trd), injection(inj),
+      seed(seed), rand_gen(seed, terminal_count, inj.mean_interval),
+      input_buf_size(input_buf_size),
+      packet_len_desc(pld)
+{
     // VC vs. Wormhole pattern (6-ary 2-torus)
     // traffic_desc = {TRF_DESIGNATED, std::vector<int>(terminal_count)};
     // traffic_desc.dests[19] = 22;
     // traffic_desc.dests[20] = 15;
 
-    channel_delay = 1; /* FIXME hardcoded */
-    packet_len = 4; /* FIXME hardcoded */
+    injection_setup(&injection, packet_len_desc);
+    rand_gen.exp_dist =
+        std::exponential_distribution<>(1.0 / injection.mean_interval);
 
     // Initialize the event system
     eventq_init(&eventq);
@@ -33,8 +53,7 @@ Sim::Sim(bool verbose_mode, int debug_mode, Topology top, int terminal_count,
         Connection conn = top.forward_hash[i].value;
         // printf("Found connection: %d.%d.%d -> %d.%d.%d\n", conn.src.id.type, conn.src.id.value,
         //        conn.src.port, conn.dst.id.type, conn.dst.id.value, conn.dst.port);
-        channels.emplace_back(&eventq, channel_delay, conn);
-        // channels.emplace_back(&eventq, channel_delay, conn);
+        channels.emplace_back(&eventq, conn);
     }
     channel_map = NULL;
     for (size_t i = 0; i < channels.size(); i++) {
@@ -42,75 +61,298 @@ Sim::Sim(bool verbose_mode, int debug_mode, Topology top, int terminal_count,
         hmput(channel_map, ch->conn.uniq, ch);
     }
 
-    // Initialize terminal nodes
-    for (int id = 0; id < terminal_count; id++) {
-        // Terminal nodes only have a single port.  Also, destination nodes
-        // doesn't have output ports!
-        Channel **src_in_chs = NULL; // empty
-        Channel **src_out_chs = NULL;
-        Channel **dst_in_chs = NULL;
-        Channel **dst_out_chs = NULL; // empty
-
-        RouterPortPair src_rpp = {src_id(id), 0};
-        RouterPortPair dst_rpp = {dst_id(id), 0};
-        Connection src_conn = conn_find_forward(&top, src_rpp);
-        Connection dst_conn = conn_find_reverse(&top, dst_rpp);
-        assert(src_conn.src.port != -1 && "Source is not connected!");
-        assert(dst_conn.src.port != -1 && "Destination is not connected!");
-        long src_idx = hmgeti(channel_map, src_conn.uniq);
-        long dst_idx = hmgeti(channel_map, dst_conn.uniq);
-        assert(src_idx >= 0);
-        assert(dst_idx >= 0);
-        Channel *src_out_ch = channel_map[src_idx].value;
-        Channel *dst_in_ch = channel_map[dst_idx].value;
-
-        arrput(src_out_chs, src_out_ch);
-        arrput(dst_in_chs, dst_in_ch);
-
-        src_nodes.push_back(std::make_unique<Router>(
-            *this, &eventq, &stat, verbose_mode, src_id(id), 1, vc_count, top.desc,
-            traffic_desc, rand_gen, packet_len, src_in_chs, src_out_chs,
-            input_buf_size));
-        dst_nodes.push_back(std::make_unique<Router>(
-            *this, &eventq, &stat, verbose_mode, dst_id(id), 1, vc_count, top.desc,
-            traffic_desc, rand_gen, packet_len, dst_in_chs, dst_out_chs,
-            input_buf_size));
-
-        arrfree(src_in_chs);
-        arrfree(src_out_chs);
-        arrfree(dst_in_chs);
-        arrfree(dst_out_chs);
-    }
-
-    // Initialize router nodes
-    for (int id = 0; id < router_count; id++) {
-        Channel **in_chs = NULL;
-        Channel **out_chs = NULL;
-
-        for (int port = 0; port < radix; port++) {
-            RouterPortPair rpp = {rtr_id(id), port};
-            Connection output_conn = conn_find_forward(&top, rpp);
-            Connection input_conn = conn_find_reverse(&top, rpp);
-            assert(output_conn.src.port != -1);
-            assert(input_conn.src.port != -1);
-            long out_idx = hmgeti(channel_map, output_conn.uniq);
-            long in_idx = hmgeti(channel_map, input_conn.uniq);
-            assert(out_idx >= 0);
-            assert(in_idx >= 0);
-            Channel *out_ch = channel_map[out_idx].value;
-            Channel *in_ch = channel_map[in_idx].value;
-
-            arrput(out_chs, out_ch);
-            arrput(in_chs, in_ch);
+    // All nodes live in a single arena.  A router is placed next to its
+    // source and destination nodes, and the routers in Morton order of their
+    // coordinates, so that nodes that talk to each other share pages and
+    // prefetched lines.
+    size_t rtr_size = router_arena_size(radix, vc_count, input_buf_size);
+    size_t term_size = router_arena_size(1, vc_count, input_buf_size);
+    arena_init(&arena, router_count * rtr_size + 2 * terminal_count * term_size);
+
+    std::vector<int> order;
+    if (top.desc.type == TOP_TORUS && terminal_count == router_count) {
+        order = torus_morton_order(top.desc.k, top.desc.r);
+        assert(static_cast<int>(order.size()) == router_count);
+    } else {
+        for (int id = 0; id < std::max(router_count, terminal_count); id++) {
+            order.push_back(id);
+        }
+    }
+
+    routers.assign(router_count, NULL);
+    src_nodes.assign(terminal_count, NULL);
+    dst_nodes.assign(terminal_count, NULL);
+    std::vector<Channel *> in_chs(radix), out_chs(radix);
+    for (int id : order) {
+        if (id < router_count) {
+            for (int port = 0; port < radix; port++) {
+                RouterPortPair rpp = {rtr_id(id), port};
+                Connection output_conn = conn_find_forward(&top, rpp);
+                Connection input_conn = conn_find_reverse(&top, rpp);
+                assert(output_conn.src.port != -1);
+                assert(input_conn.src.port != -1);
+                out_chs[port] = channel_find(channel_map, output_conn);
+                in_chs[port] = channel_find(channel_map, input_conn);
+            }
+            routers[id] = new (arena_alloc(&arena, sizeof(Router),
+                                           ARENA_ALIGN))
+                Router(*this, &arena, &eventq, &stat, verbose_mode, rtr_id(id),
+                       radix, vc_count, top.desc, traffic_desc, rand_gen,
+                       in_chs.data(), out_chs.data(), input_buf_size);
+        }
+        if (id < terminal_count) {
+            // Terminal nodes only have a single port.  Also, destination
+            // nodes doesn't have output ports!
+            RouterPortPair src_rpp = {src_id(id), 0};
+            RouterPortPair dst_rpp = {dst_id(id), 0};
+            Connection src_conn = conn_find_forward(&top, src_rpp);
+            Connection dst_conn = conn_find_reverse(&top, dst_rpp);
+            assert(src_conn.src.port != -1 && "Source is not connected!");
+            assert(dst_conn.src.port != -1 && "Destination is not connected!");
+            Channel *src_out_ch = channel_find(channel_map, src_conn);
+            Channel *dst_in_ch = channel_find(channel_map, dst_conn);
+
+            src_nodes[id] = new (arena_alloc(&arena, sizeof(Router),
+                                             ARENA_ALIGN))
+                Router(*this, &arena, &eventq, &stat, verbose_mode, src_id(id),
+                       1, vc_count, top.desc, traffic_desc, rand_gen, NULL,
+                       &src_out_ch, input_buf_size);
+            dst_nodes[id] = new (arena_alloc(&arena, sizeof(Router),
+                                             ARENA_ALIGN))
+                Router(*this, &arena, &eventq, &stat, verbose_mode, dst_id(id),
+                       1, vc_count, top.desc, traffic_desc, rand_gen,
+                       &dst_in_ch, NULL, input_buf_size);
+        }
+    }
+    assert(arena.cap - arena.used < ARENA_ALIGN);
+}
+
+static InjectionDesc config_injection(const SimConfig *cfg)
+{
+    // '-rate' is in flits/cycle/node; the Poisson process can be given either
+    // a rate or a mean interval.
+    if (cfg->inj_type != INJ_MMPP && cfg->inj_type != INJ_POISSON &&
+        cfg->rate < 0.0) {
+        fatal("%s injection requires a rate\n", injection_str(cfg->inj_type));
+    }
+    switch (cfg->inj_type) {
+    case INJ_POISSON:
+        return (cfg->rate > 0.0) ? injection_poisson_rate(cfg->rate)
+                                 : injection_poisson(cfg->mean_interval);
+    case INJ_BERNOULLI:
+        return injection_bernoulli(cfg->rate);
+    case INJ_ONOFF:
+        return injection_onoff(cfg->rate, cfg->burst);
+    case INJ_MMPP:
+        if (cfg->mmpp_rates.empty() ||
+            cfg->mmpp_rates.size() != cfg->mmpp_dwells.size() ||
+            cfg->mmpp_rates.size() > MMPP_MAX_STATES) {
+            fatal("MMPP injection requires rates and dwell times of the same "
+                  "length, up to %d\n", MMPP_MAX_STATES);
+        }
+        return injection_mmpp(static_cast<int>(cfg->mmpp_rates.size()),
+                              cfg->mmpp_rates.data(), cfg->mmpp_dwells.data());
+    case INJ_COUNT:
+        break;
+    }
+    fatal("unknown injection process\n");
+    return InjectionDesc{};
+}
+
+// Build a simulation from 'cfg', with the sources ready to start at cycle 0.
+// Each simulation owns all of its state, so that many of them can run at once
+// on different threads.  Free it with sim_destroy().
+Sim *sim_create(const SimConfig *cfg)
+{
+    int k = cfg->k, r = cfg->r;
+    int router_count = 1;
+    for (int i = 0; i < r; i++) {
+        router_count *= k;
+    }
+    int terminal_count = router_count;
+    // 1: terminal node, 2: bidirectional in each ring
+    int radix = 1 + 2 * r;
+    // 2 VCs in each dimension, unless overrided.
+    int vc_count = (cfg->vc_count == -1) ? 2 * r : cfg->vc_count;
+
+    if (r < 1 || r > NORMALLEN || k < 2) {
+        fatal("invalid torus %d-ary %d-cube\n", k, r);
+    }
+    LinkDesc dim_links[NORMALLEN];
+    for (int i = 0; i < r; i++) {
+        int n = static_cast<int>(cfg->dim_links.size());
+        dim_links[i] =
+            (n == 0) ? default_link : cfg->dim_links[std::min(i, n - 1)];
+        if (dim_links[i].delay < 1 || dim_links[i].width < 1) {
+            fatal("link delay and width should be >= 1\n");
+        }
+    }
+    if (cfg->term_link.delay < 1 || cfg->term_link.width < 1) {
+        fatal("link delay and width should be >= 1\n");
+    }
+    Topology top = topology_torus(k, r, cfg->term_link, dim_links);
+    for (const LinkOverride &lo : cfg->link_overrides) {
+        if (lo.link.delay < 1 || lo.link.width < 1) {
+            fatal("link delay and width should be >= 1\n");
+        }
+        RouterPortPair out_port = {rtr_id(lo.router), lo.port};
+        if (lo.router < 0 || lo.router >= router_count ||
+            !topology_set_link(&top, out_port, lo.link)) {
+            fatal("no link leaves router %d on port %d\n", lo.router, lo.port);
+        }
+    }
+
+    TrafficDesc trd{terminal_count};
+    if (cfg->traffic_type == TRF_HOTSPOT) {
+        trd = traffic_hotspot(terminal_count, cfg->hotspots, cfg->hotspot_rate);
+    } else {
+        trd = traffic_create(cfg->traffic_type, top.desc, terminal_count,
+                             cfg->seed);
+    }
+
+    InjectionDesc inj = config_injection(cfg);
+    inj.gen_width = cfg->term_link.width;
+
+    Sim *sim = new Sim{cfg->verbose, cfg->debug_mode, top, terminal_count,
+                       router_count, radix, vc_count, trd, inj, cfg->packet_len,
+                       cfg->input_buf_size, cfg->seed};
+    sim->quiet = cfg->quiet;
+    sim->until = cfg->cycles;
+    sim->profile.enabled = cfg->profile;
+    if (cfg->lockstep) {
+        sim->lockstep = true;
+        for (int i = 0; i < router_count; i++) {
+            router_wake(sim->routers[i], 0);
+        }
+        for (int i = 0; i < terminal_count; i++) {
+            router_wake(sim->src_nodes[i], 0);
+            router_wake(sim->dst_nodes[i], 0);
         }
+    }
 
-        routers.push_back(std::make_unique<Router>(
-            *this, &eventq, &stat, verbose_mode, rtr_id(id), radix, vc_count,
-            top.desc, traffic_desc, rand_gen, packet_len, in_chs, out_chs,
-            input_buf_size));
+    if (cfg->closed_loop) {
+        sim_set_closed_loop(sim, cfg->reply_len, cfg->max_outstanding);
+    }
+    long measure = cfg->measure;
+    if (cfg->converge > 0.0 && measure <= 0) {
+        measure = 100 * cfg->batch;
+    }
+    if (measure > 0) {
+        sim_set_phases(sim, cfg->warmup, measure);
+        long drain_max = (cfg->drain_max < 0) ? 4 * measure : cfg->drain_max;
+        sim->until = cfg->warmup + measure + drain_max;
+    }
+    if (cfg->converge > 0.0) {
+        sim_set_convergence(sim, cfg->batch, cfg->converge);
+    }
+    if (cfg->pair_hists) {
+        sim_set_pair_hists(sim);
+    }
 
-        arrfree(in_chs);
-        arrfree(out_chs);
+    if (cfg->trace) {
+        // Sources are woken up by the trace reader.
+        sim_set_trace(sim, cfg->trace);
+    } else {
+        for (int i = 0; i < terminal_count; i++) {
+            router_wake(sim->src_nodes[i], 0);
+        }
+    }
+    sim->trace_dump = cfg->trace_dump;
+    if (cfg->evtrace_path) {
+        sim->evtrace = evtrace_open(cfg->evtrace_path);
+    }
+    if (cfg->monitor_path) {
+        sim->monitor = monitor_open(cfg->monitor_path, cfg->monitor_format,
+                                    cfg->monitor_interval, sim);
+    }
+
+    return sim;
+}
+
+// Two-sided 95% Student-t quantiles for 1..30 degrees of freedom.
+static const double t_quantile95[] = {
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201,  2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080,  2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+};
+
+// Minimum number of batches before declaring convergence or saturation.
+#define MIN_BATCH_COUNT 5
+// Latency of a batch this many times that of the first one means the network
+// is saturated.
+#define SATURATION_FACTOR 4.0
+
+// Returns the half-width of the 95% confidence interval of the mean of 'v',
+// and stores the mean into 'mean'.
+static double batch_ci(const std::vector<double> &v, double *mean)
+{
+    size_t n = v.size();
+    double sum = 0.0, sq = 0.0;
+    for (double x : v) {
+        sum += x;
+    }
+    *mean = sum / n;
+    for (double x : v) {
+        sq += (x - *mean) * (x - *mean);
+    }
+    double t = (n - 1 <= 30) ? t_quantile95[n - 2] : 1.960;
+    return t * std::sqrt(sq / (n - 1)) / std::sqrt(static_cast<double>(n));
+}
+
+// Close the current batch of the measurement window.  Ends the window early
+// once the batch means of latency and throughput have converged, or flags
+// saturation once latency diverges.
+static void sim_end_batch(Sim *sim)
+{
+    Stat &st = sim->stat;
+    long end = sim->next_batch_end;
+    sim->next_batch_end += sim->batch_cycles;
+    if (end > st.measure_end) {
+        sim->next_batch_end = LONG_MAX;
+        return;
+    }
+
+    BatchMark mark = {st.latency_sum, st.packet_arrive_count,
+                      st.window_flit_gen_count, st.window_flit_arrive_count};
+    BatchMark &prev = sim->batch_mark;
+    double node_cycles = static_cast<double>(sim->batch_cycles) *
+                         static_cast<double>(sim->src_nodes.size());
+    long arrived = mark.packet_arrive_count - prev.packet_arrive_count;
+    if (arrived > 0) {
+        sim->batch_latency.push_back(
+            static_cast<double>(mark.latency_sum - prev.latency_sum) / arrived);
+    }
+    sim->batch_throughput.push_back(
+        static_cast<double>(mark.flit_arrive_count - prev.flit_arrive_count) /
+        node_cycles);
+    prev = mark;
+
+    size_t n = sim->batch_latency.size();
+    if (n < MIN_BATCH_COUNT) {
+        return;
+    }
+
+    // Saturation: the latency keeps growing with time.
+    double first = sim->batch_latency[0];
+    double last = sim->batch_latency[n - 1];
+    if (last > SATURATION_FACTOR * first && last > sim->batch_latency[n - 2] &&
+        sim->batch_latency[n - 2] > sim->batch_latency[n - 3]) {
+        sim->saturated = true;
+        st.measure_end = end;
+        sim->measure_cycles = end - st.measure_start;
+        return;
+    }
+
+    double lat_mean, thr_mean;
+    double lat_ci = batch_ci(sim->batch_latency, &lat_mean);
+    double thr_ci = batch_ci(sim->batch_throughput, &thr_mean);
+    if (lat_ci <= sim->converge_ci * lat_mean &&
+        thr_ci <= sim->converge_ci * thr_mean) {
+        // Converged: stop tagging and start draining.
+        sim->converged = true;
+        st.measure_end = end;
+        sim->measure_cycles = end - st.measure_start;
+        sim->next_batch_end = LONG_MAX;
     }
 }
 
@@ -118,13 +360,42 @@ void sim_run_until(Sim *sim, long until)
 {
     long last_print_cycle = 0;
 
-    while (!eventq_empty(&sim->eventq)) {
+    while (true) {
+        // Feed the source nodes with upcoming trace records.
+        if (sim->trace) {
+            trace_refill(sim->trace, sim);
+        }
+        if (eventq_empty(&sim->eventq)) {
+            break;
+        }
         // Terminate simulation if the specified time is expired
         if (0 <= until && until < next_time(&sim->eventq)) {
             break;
         }
+        // Or if all the sampled packets have arrived, once the cycle is over.
+        if (next_time(&sim->eventq) > curr_time(&sim->eventq) &&
+            sim_drained(sim)) {
+            break;
+        }
+        if (sim->monitor &&
+            next_time(&sim->eventq) >= sim->monitor->next_sample) {
+            monitor_sample(sim->monitor, sim, sim->monitor->next_sample);
+            continue;
+        }
+        if (next_time(&sim->eventq) >= sim->next_batch_end) {
+            sim_end_batch(sim);
+            if (sim->saturated) {
+                break;
+            }
+            continue;
+        }
+        if (sim->profile.enabled) {
+            sim->profile.event_count++;
+            sim->profile.peak_queue =
+                std::max(sim->profile.peak_queue, eventq_size(&sim->eventq));
+        }
         Event e = eventq_pop(&sim->eventq);
-        if (sim->eventq.curr_time() != last_print_cycle &&
+        if (!sim->quiet && sim->eventq.curr_time() != last_print_cycle &&
             sim->eventq.curr_time() % 100 == 0) {
             printf("[@%3ld/%3ld]\n", sim->eventq.curr_time(), until);
             last_print_cycle = sim->eventq.curr_time();
@@ -133,6 +404,93 @@ void sim_run_until(Sim *sim, long until)
     }
 }
 
+// Drive packet injection from a trace instead of the synthetic traffic.
+// Sources stay idle until the trace reader dispatches a record to them.
+void sim_set_trace(Sim *sim, TraceReader *trace)
+{
+    sim->trace = trace;
+    for (Router *src : sim->src_nodes) {
+        src->sg.next_packet_start = LONG_MAX;
+    }
+}
+
+// Switch to closed-loop traffic: every request arriving at a destination is
+// answered with a reply of 'reply_len' flits, and each source may have at most
+// 'max_outstanding' unanswered requests.  Requests and replies use disjoint
+// halves of the VCs to avoid protocol deadlock.
+void sim_set_closed_loop(Sim *sim, long reply_len, int max_outstanding)
+{
+    int vc_count = sim->routers[0]->vc_count;
+    if (vc_count % MSG_CLASS_COUNT != 0) {
+        fatal("closed-loop traffic needs a multiple of %d VCs\n",
+              MSG_CLASS_COUNT);
+    }
+    if (reply_len < 1 || max_outstanding < 1) {
+        fatal("reply length and max outstanding must be positive\n");
+    }
+
+    sim->closed_loop = true;
+    sim->reply_len = reply_len;
+    sim->max_outstanding = max_outstanding;
+    for (Router *r : sim->src_nodes) {
+        router_set_msg_classes(r, MSG_CLASS_COUNT);
+    }
+    for (Router *r : sim->dst_nodes) {
+        router_set_msg_classes(r, MSG_CLASS_COUNT);
+    }
+    for (Router *r : sim->routers) {
+        router_set_msg_classes(r, MSG_CLASS_COUNT);
+    }
+}
+
+// Use the three-phase methodology: run 'warmup_cycles' without sampling, then
+// tag the packets generated within the next 'measure_cycles', and keep running
+// (and injecting) until all of them have arrived.
+void sim_set_phases(Sim *sim, long warmup_cycles, long measure_cycles)
+{
+    if (warmup_cycles < 0 || measure_cycles <= 0) {
+        fatal("invalid warmup/measurement cycles\n");
+    }
+    sim->warmup_cycles = warmup_cycles;
+    sim->measure_cycles = measure_cycles;
+    sim->stat.measure_start = warmup_cycles;
+    sim->stat.measure_end = warmup_cycles + measure_cycles;
+}
+
+// Stop the measurement window as soon as the 95% confidence intervals of the
+// batch means of latency and throughput are within 'ci' of the mean.  Batches
+// are 'batch_cycles' long.
+void sim_set_convergence(Sim *sim, long batch_cycles, double ci)
+{
+    if (sim->measure_cycles <= 0) {
+        fatal("convergence detection needs a measurement window\n");
+    }
+    if (batch_cycles <= 0 || ci <= 0.0) {
+        fatal("invalid batch size or confidence interval\n");
+    }
+    sim->batch_cycles = batch_cycles;
+    sim->converge_ci = ci;
+    sim->next_batch_end = sim->stat.measure_start + batch_cycles;
+}
+
+// Keep a latency histogram for every source/destination pair.
+void sim_set_pair_hists(Sim *sim)
+{
+    int n = static_cast<int>(sim->src_nodes.size());
+    sim->stat.pair_hist_nodes = n;
+    sim->stat.pair_hists.assign(static_cast<size_t>(n) * n, NULL);
+}
+
+// Returns true if the measurement window is over and every tagged packet has
+// arrived.
+bool sim_drained(const Sim *sim)
+{
+    const Stat &st = sim->stat;
+    return sim->measure_cycles > 0 &&
+           curr_time(&sim->eventq) >= st.measure_end &&
+           st.packet_arrive_count == st.tagged_gen_count;
+}
+
 // Returns 1 if the simulation is NOT terminated, 0 otherwise.
 int sim_debug_step(Sim *sim)
 {
@@ -154,7 +512,7 @@ int sim_debug_step(Sim *sim)
         return 1;
     } else if (!strcmp(line, "p")) {
         for (size_t i = 0; i < sim->routers.size(); i++) {
-            router_print_state(sim->routers[i].get());
+            router_print_state(sim->routers[i]);
         }
         return 1;
     }
@@ -183,36 +541,81 @@ int sim_debug_step(Sim *sim)
 }
 
 // Run the simulator.
-void sim_run(Sim *sim, long until)
+void sim_run(Sim *sim)
 {
     if (sim->debug_mode) {
         while (sim_debug_step(sim));
     } else {
-        sim_run_until(sim, until);
+        long start_cycle = sim->eventq.curr_time();
+        uint64_t start = sim->profile.enabled ? prof_clock() : 0;
+        sim_run_until(sim, sim->until);
+        if (sim->profile.enabled) {
+            sim->profile.run_ns += prof_clock() - start;
+            sim->profile.run_cycles += sim->eventq.curr_time() - start_cycle;
+        }
+    }
+    // Flush the last, partial window.
+    if (sim->monitor) {
+        monitor_sample(sim->monitor, sim, sim->eventq.curr_time() + 1);
     }
 }
 
-void channel_xy_load(Sim *sim) {
-    // Determine the direction of this channel.
-    for (auto &ch : sim->channels) {
-        auto src = ch.conn.src.id;
-        auto dst = ch.conn.dst.id;
+// Accepted throughput below this fraction of the offered load means the
+// network could not keep up.
+#define SATURATION_ACCEPT_RATIO 0.95
 
-        // Skip terminal channels.
-        if (is_src(src) || is_dst(src) || is_src(dst) || is_dst(dst)) {
-            continue;
-        }
+SimResult sim_result(const Sim *sim)
+{
+    const Hist *h = &sim->stat.packet_hist;
+    SimResult res;
+    res.cycles = curr_time(&sim->eventq);
+    res.offered = sim_offered_load(sim);
+    res.accepted = sim_accepted_throughput(sim);
+    res.saturated = sim->saturated ||
+                    (sim->measure_cycles > 0 && !sim_drained(sim)) ||
+                    res.accepted < SATURATION_ACCEPT_RATIO * res.offered;
+    res.packet_count = h->count;
+    res.latency_mean = hist_mean(h);
+    res.latency_p50 = hist_percentile(h, 50.0);
+    res.latency_p99 = hist_percentile(h, 99.0);
+    res.latency_p999 = hist_percentile(h, 99.9);
+    res.latency_max = h->max;
+    return res;
+}
 
-        int dimension = 0;
-        for (; dimension < sim->topology.desc.r; dimension++) {
-            int src_id = torus_id_xyz_get(ch.conn.src.id.value, sim->topology.desc.k, dimension);
-            int dst_id = torus_id_xyz_get(ch.conn.dst.id.value, sim->topology.desc.k, dimension);
-            if (src_id == dst_id) {
-                break;
-            }
+// Node-cycles covered by the measurement window so far.
+static double window_node_cycles(const Sim *sim)
+{
+    long window_end = std::min(curr_time(&sim->eventq), sim->stat.measure_end);
+    return static_cast<double>(window_end - sim->stat.measure_start) *
+           static_cast<double>(sim->src_nodes.size());
+}
+
+// Offered load in flits/cycle/node, over the measurement window.  Sources
+// count the flits of a packet when it starts generating; the flits of the
+// packets still generating are taken back out up to the current cycle.
+double sim_offered_load(const Sim *sim)
+{
+    const Stat &st = sim->stat;
+    long now = curr_time(&sim->eventq);
+    long flits = st.window_flit_gen_count;
+    for (const Router *src : sim->src_nodes) {
+        // Only the last packet queued may still be generating.
+        const Ring<SourcePacket> *q = &src->source_queue;
+        if (!ring_empty(q)) {
+            const SourcePacket &p = ring_at(q, ring_len(q) - 1);
+            flits -= source_packet_generated_between(
+                p, std::max(now + 1, st.measure_start), st.measure_end);
         }
-        printf("channel direction=%d, load=%ld\n", dimension, ch.load_count);
     }
+    return static_cast<double>(flits) / window_node_cycles(sim);
+}
+
+// Accepted throughput in flits/cycle/node, over the measurement window.
+double sim_accepted_throughput(const Sim *sim)
+{
+    return static_cast<double>(sim->stat.window_flit_arrive_count) /
+           window_node_cycles(sim);
 }
 
 void sim_report(Sim *sim) {
@@ -220,26 +623,46 @@ void sim_report(Sim *sim) {
 
     // Sample router for fetching topology info.
     assert(!sim->routers.empty());
-    Router &r = *sim->routers[0].get();
+    Router &r = *sim->routers[0];
 
     printf("\n");
     printf("==== SIMULATION RESULT ====\n");
 
     printf("Topology: %d-ary %d-torus\n", sim->topology.desc.k, sim->topology.desc.r); 
+    printf("Traffic: %s\n", traffic_str(sim->traffic_desc.type));
+    printf("Injection: %s\n", injection_str(sim->injection.type));
+    printf("Seed: %lu\n", static_cast<unsigned long>(sim->seed));
     printf("Radix: %d\n", r.radix); 
     printf("# of VCs per channel: %d\n", r.vc_count); 
+    printf("Min. link delay (lookahead): %ld cycles\n",
+           topology_min_delay(&sim->topology));
     printf("# of total cycle: %ld\n", curr_time(&sim->eventq));
     printf("# of double ticks: %ld\n", sim->stat.double_tick_count);
+    if (sim->measure_cycles > 0) {
+        long drain = curr_time(&sim->eventq) - sim->stat.measure_end;
+        printf("Warmup/measure/drain: %ld/%ld/%ld cycles\n",
+               sim->warmup_cycles, sim->measure_cycles, drain > 0 ? drain : 0);
+        printf("Tagged packets: %ld/%ld arrived%s\n",
+               sim->stat.packet_arrive_count, sim->stat.tagged_gen_count,
+               sim_drained(sim) ? "" : " (drain incomplete)");
+    }
+    if (sim->batch_cycles > 0) {
+        printf("Batches: %zu of %ld cycles, %s\n",
+               sim->batch_throughput.size(), sim->batch_cycles,
+               sim->saturated   ? "saturated"
+               : sim->converged ? "converged"
+                                : "not converged");
+    }
     printf("\n");
 
     for (size_t i = 0; i < sim->src_nodes.size(); i++) {
-        Router *src = sim->src_nodes[i].get();
+        Router *src = sim->src_nodes[i];
         printf("[%s] ", id_str(src->id, s));
         printf("# of flits departed: %ld\n", src->flit_depart_count);
     }
 
     for (size_t i = 0; i < sim->dst_nodes.size(); i++) {
-        Router *dst = sim->dst_nodes[i].get();
+        Router *dst = sim->dst_nodes[i];
         printf("[%s] ", id_str(dst->id, s));
         printf("# of flits arrived: %ld\n", dst->flit_arrive_count);
     }
@@ -257,27 +680,94 @@ void sim_report(Sim *sim) {
                         static_cast<float>(sim->stat.packet_arrive_count);
     printf("Average latency: %lf\n", latency_avg);
 
-    // channel_xy_load(sim);
+    // Break down the latency by packet length, unless they are all the same.
+    if (sim->stat.size_stats.size() > 1) {
+        for (const auto &kv : sim->stat.size_stats) {
+            const SizeStat &ss = kv.second;
+            printf("  %3ld-flit packets: %ld arrived, average latency: %lf\n",
+                   kv.first, ss.packet_arrive_count,
+                   static_cast<double>(ss.latency_sum) /
+                       static_cast<double>(ss.packet_arrive_count));
+        }
+    }
+
+    printf("Offered load: %lf flits/cycle/node\n", sim_offered_load(sim));
+    printf("Accepted throughput: %lf flits/cycle/node\n",
+           sim_accepted_throughput(sim));
+
+    hist_print("Packet latency", &sim->stat.packet_hist);
+    hist_print("Network latency", &sim->stat.network_hist);
+    hist_print("Source queueing delay", &sim->stat.queueing_hist);
+    if (sim->stat.pair_hist_nodes > 0) {
+        int n = sim->stat.pair_hist_nodes;
+        printf("Packet latency per pair:\n");
+        for (int src = 0; src < n; src++) {
+            for (int dst = 0; dst < n; dst++) {
+                const Hist *h = sim->stat.pair_hists[src * n + dst];
+                if (!h) {
+                    continue;
+                }
+                char name[64];
+                snprintf(name, sizeof(name), "  %d -> %d", src, dst);
+                hist_print(name, h);
+            }
+        }
+    }
+
+    if (sim->closed_loop) {
+        printf("Replies received: %ld\n", sim->stat.reply_arrive_count);
+        printf("Average round-trip latency: %lf\n",
+               static_cast<double>(sim->stat.rtt_sum) /
+                   sim->stat.reply_arrive_count);
+    }
+
+    if (sim->profile.enabled) {
+        printf("\n");
+        profile_print(&sim->profile);
+    }
 }
 
 // Process an event.
 void sim_process(Sim *sim, Event e)
 {
     if (is_src(e.id)) {
-        e.f(sim->src_nodes[e.id.value].get());
+        e.f(sim->src_nodes[e.id.value]);
     } else if (is_dst(e.id)) {
-        e.f(sim->dst_nodes[e.id.value].get());
+        e.f(sim->dst_nodes[e.id.value]);
     } else if (is_rtr(e.id)) {
-        e.f(sim->routers[e.id.value].get());
+        e.f(sim->routers[e.id.value]);
     } else {
         assert(0);
     }
 }
 
+// Free the simulation created by sim_create(), along with everything it owns.
 void sim_destroy(Sim *sim)
 {
     hmfree(sim->channel_map);
+    if (sim->evtrace) {
+        evtrace_close(sim->evtrace);
+    }
+    if (sim->monitor) {
+        monitor_close(sim->monitor);
+    }
+    for (Hist *h : sim->stat.pair_hists) {
+        delete h;
+    }
 
     // Stat
     eventq_destroy(&sim->eventq);
+    // Routers hold pointers into the channels, so free them first.
+    for (Router *r : sim->routers) {
+        r->~Router();
+    }
+    for (Router *r : sim->src_nodes) {
+        r->~Router();
+    }
+    for (Router *r : sim->dst_nodes) {
+        r->~Router();
+    }
+    arena_free(&sim->arena);
+    topology_destroy(&sim->topology);
+    delete sim;
 }
@@ -3,8 +3,11 @@
 
 #include "event.h"
 #include "router.h"
+#include "trace.h"
+#include "evtrace.h"
+#include "monitor.h"
+#include "profile.h"
 #include <vector>
-#include <memory>
 
 void fatal(const char *fmt, ...);
 
@@ -13,30 +16,152 @@ typedef struct ChannelMap {
     Channel *value;
 } ChannelMap;
 
+// Snapshot of the running counters at a batch boundary.
+typedef struct BatchMark {
+    long latency_sum;
+    long packet_arrive_count;
+    long flit_gen_count;
+    long flit_arrive_count;
+} BatchMark;
+
+// Properties of the inter-switch or ejection link that leaves router
+// 'router' on output port 'port'.
+struct LinkOverride {
+    int router;
+    int port;
+    LinkDesc link;
+};
+
+// Everything needed to build a simulation.  The defaults give a 4-ary
+// 2-torus under uniform random Poisson traffic of 4-flit packets.
+typedef struct SimConfig {
+    bool verbose = false;
+    int debug_mode = 0;
+    bool quiet = false; // no progress output
+    long cycles = 10000; // ignored if a measurement window is given
+    uint64_t seed = 1;
+
+    // Topology.
+    int k = 4, r = 2;
+    int vc_count = -1; // default: 2 per dimension
+    long input_buf_size = 10;
+    LinkDesc term_link = default_link;
+    // Links of each dimension.  The last one is repeated for the remaining
+    // dimensions; default_link if empty.
+    std::vector<LinkDesc> dim_links;
+    // Single links that differ from the above, e.g. a slow or a narrow one.
+    std::vector<LinkOverride> link_overrides;
+
+    // Traffic.
+    TrafficType traffic_type = TRF_UNIFORM_RANDOM;
+    std::vector<int> hotspots = {0};
+    double hotspot_rate = 0.1;
+    InjectionType inj_type = INJ_POISSON;
+    double rate = -1.0;         // offered load in flits/cycle/node
+    double mean_interval = 0.0; // Poisson only, used if 'rate' is not given
+    double burst = 20.0;        // on/off only
+    std::vector<double> mmpp_rates;
+    std::vector<double> mmpp_dwells;
+    PacketLenDesc packet_len = packet_len_fixed(4);
+    TraceReader *trace = NULL;      // not owned
+    TraceWriter *trace_dump = NULL; // not owned
+    const char *evtrace_path = NULL; // pipeline event trace, if not NULL
+    // Utilization time series, if 'monitor_path' is not NULL.
+    const char *monitor_path = NULL;
+    MonitorFormat monitor_format = MON_CSV;
+    long monitor_interval = 1000;
+    bool profile = false; // self-profiling of the simulator
+    // Tick every node in every cycle instead of only the busy ones.  Slow,
+    // but a reference for checking that idle nodes are woken up in time.
+    bool lockstep = false;
+
+    // Closed-loop request/reply traffic.
+    bool closed_loop = false;
+    long reply_len = 4;
+    int max_outstanding = 4;
+
+    // Measurement methodology.
+    long warmup = 0;
+    long measure = -1;   // measurement window, -1 if none
+    long drain_max = -1; // default: 4 times the measurement window
+    long batch = 1000;
+    double converge = -1.0; // -1 if convergence detection is off
+    bool pair_hists = false;
+} SimConfig;
+
+// Summary of a finished simulation.
+typedef struct SimResult {
+    long cycles;
+    bool saturated;
+    double offered;  // flits/cycle/node
+    double accepted; // flits/cycle/node
+    long packet_count;
+    double latency_mean;
+    long latency_p50;
+    long latency_p99;
+    long latency_p999;
+    long latency_max;
+} SimResult;
+
 typedef struct Sim {
     Sim(bool verbose_mode, int debug_mode, Topology top, int terminal_count,
-        int router_count, int radix, int vc_count, double mean_interval,
-        long input_buf_size);
+        int router_count, int radix, int vc_count, TrafficDesc trd,
+        InjectionDesc inj, PacketLenDesc pld, long input_buf_size,
+        uint64_t seed);
 
     EventQueue eventq; // global event queue
     Stat stat;
     int debug_mode;
+    bool quiet = false; // no progress output
+    long until = -1;    // cycle to stop at, -1 if none
+    bool lockstep = false; // tick every node in every cycle
     Topology topology;
     TrafficDesc traffic_desc;
-    RandomGenerator rand_gen;
+    InjectionDesc injection;
+    uint64_t seed; // all random streams are derived from this
+    RandomGenerator rand_gen; // copied to every node, on its own stream
     long input_buf_size; // router input buffer size
-    long channel_delay;
-    long packet_len;    // length of a packet in flits
+    PacketLenDesc packet_len_desc; // length of packets in flits
+    TraceReader *trace = NULL;     // drives injection if not NULL
+    TraceWriter *trace_dump = NULL; // records generated packets if not NULL
+    EvTrace *evtrace = NULL;        // records pipeline events if not NULL
+    Monitor *monitor = NULL;        // samples utilization if not NULL
+    Profile profile;                // simulator self-profiling
+    bool closed_loop = false; // destinations answer requests with replies
+    long reply_len = 1;       // length of reply packets in flits
+    int max_outstanding = 1;  // max unanswered requests per source
+    long warmup_cycles = 0;   // cycles before the measurement window
+    long measure_cycles = -1; // length of the measurement window, -1 if none
+    // Batch means for convergence and saturation detection.
+    long batch_cycles = 0;    // batch length, 0 if disabled
+    double converge_ci = 0.0; // relative 95% CI half-width to stop at
+    long next_batch_end = LONG_MAX;
+    BatchMark batch_mark = {};
+    std::vector<double> batch_latency;
+    std::vector<double> batch_throughput;
+    bool converged = false;
+    bool saturated = false;
     ChannelMap *channel_map;
     std::vector<Channel> channels;
-    std::vector<std::unique_ptr<Router>> routers;
-    std::vector<std::unique_ptr<Router>> src_nodes;
-    std::vector<std::unique_ptr<Router>> dst_nodes;
+    Arena arena; // holds all nodes below
+    std::vector<Router *> routers;
+    std::vector<Router *> src_nodes;
+    std::vector<Router *> dst_nodes;
 } Sim;
 
-void sim_run(Sim *sim, long until);
+Sim *sim_create(const SimConfig *cfg);
+void sim_set_trace(Sim *sim, TraceReader *trace);
+void sim_set_closed_loop(Sim *sim, long reply_len, int max_outstanding);
+void sim_set_phases(Sim *sim, long warmup_cycles, long measure_cycles);
+bool sim_drained(const Sim *sim);
+void sim_set_convergence(Sim *sim, long batch_cycles, double ci);
+void sim_set_pair_hists(Sim *sim);
+void sim_run(Sim *sim);
 void sim_process(Sim *sim, Event e);
 void sim_report(Sim *sim);
+double sim_offered_load(const Sim *sim);
+double sim_accepted_throughput(const Sim *sim);
+SimResult sim_result(const Sim *sim);
 void sim_destroy(Sim *sim);
 
 #endif
@@ -0,0 +1,85 @@
+#include "sweep.h"
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+// Simulate 'base' at the injection rate of 'pt'.
+static void sweep_point(const SimConfig *base, SweepPoint *pt)
+{
+    SimConfig cfg = *base;
+    cfg.rate = pt->rate;
+    cfg.quiet = true;
+    if (cfg.measure <= 0) {
+        // Saturation is told by the tagged packets that fail to drain.
+        cfg.measure = cfg.cycles;
+    }
+
+    Sim *sim = sim_create(&cfg);
+    sim_run(sim);
+    pt->result = sim_result(sim);
+    pt->done = true;
+    sim_destroy(sim);
+}
+
+// Simulate each injection rate in its own Sim, 'thread_count' of them at a
+// time, in increasing order of the rate.  Once a rate saturates the network,
+// the higher rates that have not started yet are skipped.
+std::vector<SweepPoint> sweep_run(const SimConfig *base,
+                                  std::vector<double> rates,
+                                  int thread_count)
+{
+    std::sort(rates.begin(), rates.end());
+    std::vector<SweepPoint> points(rates.size());
+    for (size_t i = 0; i < rates.size(); i++) {
+        points[i] = SweepPoint{};
+        points[i].rate = rates[i];
+    }
+
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> first_saturated{rates.size()};
+    auto worker = [&]() {
+        size_t i;
+        while ((i = next++) < points.size()) {
+            if (i > first_saturated) {
+                continue;
+            }
+            sweep_point(base, &points[i]);
+            const SimResult &res = points[i].result;
+            fprintf(stderr, "rate %.4lf: accepted %.4lf, latency %.2lf%s\n",
+                    points[i].rate, res.accepted, res.latency_mean,
+                    res.saturated ? " (saturated)" : "");
+            if (res.saturated) {
+                size_t prev = first_saturated;
+                while (i < prev &&
+                       !first_saturated.compare_exchange_weak(prev, i));
+            }
+        }
+    };
+
+    thread_count = std::max(1, std::min<int>(thread_count, rates.size()));
+    std::vector<std::thread> threads;
+    for (int t = 0; t < thread_count; t++) {
+        threads.emplace_back(worker);
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    return points;
+}
+
+void sweep_write_csv(FILE *f, const std::vector<SweepPoint> &points)
+{
+    fprintf(f, "rate,offered,accepted,latency_mean,latency_p50,latency_p99,"
+               "latency_p999,latency_max,cycles,saturated\n");
+    for (const SweepPoint &pt : points) {
+        if (!pt.done) {
+            continue;
+        }
+        const SimResult &res = pt.result;
+        fprintf(f, "%lf,%lf,%lf,%lf,%ld,%ld,%ld,%ld,%ld,%d\n", pt.rate,
+                res.offered, res.accepted, res.latency_mean, res.latency_p50,
+                res.latency_p99, res.latency_p999, res.latency_max, res.cycles,
+                res.saturated);
+    }
+}
@@ -0,0 +1,20 @@
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include "sim.h"
+#include <stdio.h>
+#include <vector>
+
+// One point of a latency-vs-offered-load curve.
+struct SweepPoint {
+    double rate; // requested injection rate in flits/cycle/node
+    bool done;   // false if skipped for being past saturation
+    SimResult result;
+};
+
+std::vector<SweepPoint> sweep_run(const SimConfig *base,
+                                  std::vector<double> rates,
+                                  int thread_count);
+void sweep_write_csv(FILE *f, const std::vector<SweepPoint> &points);
+
+#endif
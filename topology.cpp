@@ -1,5 +1,6 @@
 #include "router.h"
 #include <assert.h>
+#include <algorithm>
 
 // Get the component of id along 'direction' axis.
 int torus_id_xyz_get(int id, int k, int direction)
@@ -41,7 +42,8 @@ void topology_destroy(Topology *top)
     hmfree(top->reverse_hash);
 }
 
-int topology_connect(Topology *t, RouterPortPair input, RouterPortPair output)
+int topology_connect(Topology *t, RouterPortPair input, RouterPortPair output,
+                     LinkDesc link)
 {
     int old_output_i = hmgeti(t->forward_hash, input);
     int old_input_i = hmgeti(t->reverse_hash, output);
@@ -64,14 +66,44 @@ int topology_connect(Topology *t, RouterPortPair input, RouterPortPair output)
         }
     }
     int uniq = hmlen(t->forward_hash);
-    Connection conn = (Connection){.src = input, .dst = output, .uniq = uniq};
+    Connection conn =
+        (Connection){.src = input, .dst = output, .uniq = uniq, .link = link};
     hmput(t->forward_hash, input, conn);
     hmput(t->reverse_hash, output, conn);
     assert(hmgeti(t->forward_hash, input) >= 0);
     return 1;
 }
 
-int topology_connect_terminals(Topology *t, const int *ids)
+// Override the physical properties of the link that starts at 'out_port'.
+// Returns 0 if there is no such link.
+int topology_set_link(Topology *t, RouterPortPair out_port, LinkDesc link)
+{
+    assert(link.delay >= 1 && link.width >= 1);
+    ptrdiff_t fwd_i = hmgeti(t->forward_hash, out_port);
+    if (fwd_i < 0)
+        return 0;
+    RouterPortPair in_port = t->forward_hash[fwd_i].value.dst;
+    ptrdiff_t rev_i = hmgeti(t->reverse_hash, in_port);
+    assert(rev_i >= 0);
+    t->forward_hash[fwd_i].value.link = link;
+    t->reverse_hash[rev_i].value.link = link;
+    return 1;
+}
+
+// Smallest link delay in the topology.  This is the lookahead that a parallel
+// simulation can exploit between routers.
+long topology_min_delay(const Topology *t)
+{
+    long min_delay = -1;
+    for (ptrdiff_t i = 0; i < hmlen(t->forward_hash); i++) {
+        long delay = t->forward_hash[i].value.link.delay;
+        if (min_delay < 0 || delay < min_delay)
+            min_delay = delay;
+    }
+    return min_delay;
+}
+
+int topology_connect_terminals(Topology *t, const int *ids, LinkDesc link)
 {
     int res = 1;
     for (int i = 0; i < arrlen(ids); i++) {
@@ -80,8 +112,8 @@ int topology_connect_terminals(Topology *t, const int *ids)
         RouterPortPair rtr_port = {rtr_id(ids[i]), 0};
 
         // Bidirectional channel
-        res &= topology_connect(t, src_port, rtr_port);
-        res &= topology_connect(t, rtr_port, dst_port);
+        res &= topology_connect(t, src_port, rtr_port, link);
+        res &= topology_connect(t, rtr_port, dst_port, link);
         if (!res)
             return 0;
     }
@@ -96,13 +128,9 @@ int get_output_port(int direction, int to_larger)
 }
 
 // Port usage: 0:terminal, 1:counter-clockwise, 2:clockwise
-static int topology_connect_ring(Topology *t, long size, const int *ids, int direction)
+static int topology_connect_ring(Topology *t, long size, const int *ids,
+                                 int direction, LinkDesc link)
 {
-    printf("%s: ids={", __func__);
-    for (long i = 0; i < size; i++)
-        printf("%d,", ids[i]);
-    printf("}\n");
-
     int port_cw = get_output_port(direction, 1);
     int port_ccw = get_output_port(direction, 0);
     int res = 1;
@@ -113,8 +141,8 @@ static int topology_connect_ring(Topology *t, long size, const int *ids, int dir
         RouterPortPair rport = {rtr_id(r), port_ccw};
 
         // Bidirectional channel
-        res &= topology_connect(t, lport, rport);
-        res &= topology_connect(t, rport, lport);
+        res &= topology_connect(t, lport, rport, link);
+        res &= topology_connect(t, rport, lport, link);
         if (!res)
             return 0;
     }
@@ -126,8 +154,10 @@ static int topology_connect_ring(Topology *t, long size, const int *ids, int dir
 //
 // dimension: size of the 'normal' array.
 // offset: offset of the lowest index.
+// dim_links: link properties for each dimension.
 int topology_connect_torus_dimension(Topology *t, int k, int r, int dimension,
-                                     int *normal, int offset)
+                                     int *normal, int offset,
+                                     const LinkDesc *dim_links)
 {
     int res = 1;
     int zeros = 0;
@@ -143,7 +173,7 @@ int topology_connect_torus_dimension(Topology *t, int k, int r, int dimension,
                 int ids[NORMALLEN];
                 for (int j = 0; j < k; j++)
                     ids[j] = offset + j * stride;
-                res &= topology_connect_ring(t, k, ids, i);
+                res &= topology_connect_ring(t, k, ids, i, dim_links[i]);
                 break; // only one 0 in normal
             }
         }
@@ -157,7 +187,7 @@ int topology_connect_torus_dimension(Topology *t, int k, int r, int dimension,
                 for (int j = 0; j < k; j++) {
                     int suboffset = offset + j * stride;
                     res &= topology_connect_torus_dimension(
-                        t, k, r, dimension, subnormal, suboffset);
+                        t, k, r, dimension, subnormal, suboffset, dim_links);
                 }
             }
         }
@@ -166,16 +196,24 @@ int topology_connect_torus_dimension(Topology *t, int k, int r, int dimension,
     return res;
 }
 
-Topology topology_torus(int k, int r)
+// term_link: link properties of the terminal channels.
+// dim_links: link properties of the inter-switch channels along each
+//            dimension. Has 'r' elements. NULL means default links.
+Topology topology_torus(int k, int r, LinkDesc term_link,
+                        const LinkDesc *dim_links)
 {
     Topology top = topology_create();
     top.desc = (TopoDesc){TOP_TORUS, k, r};
 
     int normal[NORMALLEN] = {0};
+    LinkDesc links[NORMALLEN] = {};
     int res = 1;
 
+    for (int i = 0; i < r; i++)
+        links[i] = dim_links ? dim_links[i] : default_link;
+
     // Inter-switch channels
-    res &= topology_connect_torus_dimension(&top, k, r, r, normal, 0);
+    res &= topology_connect_torus_dimension(&top, k, r, r, normal, 0, links);
 
     // Terminal channels
     int total_nodes = 1;
@@ -184,7 +222,7 @@ Topology topology_torus(int k, int r)
     for (int id = 0; id < total_nodes; id++) {
         arrput(ids, id);
     }
-    res &= topology_connect_terminals(&top, ids);
+    res &= topology_connect_terminals(&top, ids, term_link);
     assert(res);
 
     arrfree(ids);
@@ -208,3 +246,40 @@ int torus_align_id(int k, int src_id, int dst_id, int move_direction)
     int component = torus_id_xyz_get(dst_id, k, move_direction);
     return torus_id_xyz_set(src_id, k, move_direction, component);
 }
+
+// Morton (Z-order) key of a torus node: the bits of its coordinates
+// interleaved, so that nodes close in the torus get close keys.
+static uint64_t torus_morton_key(int id, int k, int r)
+{
+    int bits = 0;
+    while ((1 << bits) < k)
+        bits++;
+    assert(bits * r <= 64);
+    uint64_t key = 0;
+    for (int b = 0; b < bits; b++) {
+        for (int dir = 0; dir < r; dir++) {
+            uint64_t bit = (torus_id_xyz_get(id, k, dir) >> b) & 1;
+            key |= bit << (b * r + dir);
+        }
+    }
+    return key;
+}
+
+// IDs of the nodes of a k-ary r-cube in Morton order.  Laying out per-node
+// state in this order keeps the neighbors of a node, which exchange flits and
+// credits with it every cycle, mostly in nearby memory.
+std::vector<int> torus_morton_order(int k, int r)
+{
+    int n = 1;
+    for (int i = 0; i < r; i++)
+        n *= k;
+    std::vector<uint64_t> keys(n);
+    std::vector<int> order(n);
+    for (int id = 0; id < n; id++) {
+        keys[id] = torus_morton_key(id, k, r);
+        order[id] = id;
+    }
+    std::sort(order.begin(), order.end(),
+              [&keys](int a, int b) { return keys[a] < keys[b]; });
+    return order;
+}
@@ -0,0 +1,177 @@
+#include "trace.h"
+#include "sim.h"
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+TraceReader *trace_open(const char *path, int terminal_count, long lookahead)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fatal("cannot open trace '%s': %s\n", path, strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        fatal("cannot stat trace '%s': %s\n", path, strerror(errno));
+    }
+    size_t size = st.st_size;
+    if (size < sizeof(TraceHeader)) {
+        fatal("trace '%s' is too small\n", path);
+    }
+
+    char *map = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        fatal("cannot mmap trace '%s': %s\n", path, strerror(errno));
+    }
+    // Records are consumed strictly in order.
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    const TraceHeader *hdr = (const TraceHeader *)map;
+    if (memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->version != TRACE_VERSION) {
+        fatal("'%s' is not a version %d trace file\n", path, TRACE_VERSION);
+    }
+    if (hdr->record_size != sizeof(TraceRecord) ||
+        size < sizeof(TraceHeader) + hdr->record_count * sizeof(TraceRecord)) {
+        fatal("trace '%s' is truncated or corrupt\n", path);
+    }
+
+    TraceReader *tr = new TraceReader;
+    tr->fd = fd;
+    tr->map = map;
+    tr->map_size = size;
+    tr->records = (const TraceRecord *)(map + sizeof(TraceHeader));
+    tr->record_count = hdr->record_count;
+    tr->lookahead = lookahead;
+    tr->pending.resize(terminal_count);
+    return tr;
+}
+
+void trace_close(TraceReader *tr)
+{
+    munmap(tr->map, tr->map_size);
+    close(tr->fd);
+    delete tr;
+}
+
+// Release the pages that the cursor has passed, so that the resident size
+// stays bounded regardless of the trace size.
+static void trace_release(TraceReader *tr)
+{
+    static const size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t offset = sizeof(TraceHeader) + tr->cursor * sizeof(TraceRecord);
+    size_t end = offset & ~(page_size - 1);
+    if (end - tr->released >= TRACE_RELEASE_CHUNK) {
+        madvise(tr->map + tr->released, end - tr->released, MADV_DONTNEED);
+        tr->released = end;
+    }
+}
+
+// Hand a record over to its source node, waking up the source if it was not
+// waiting for any packet.
+static void trace_dispatch(TraceReader *tr, Sim *sim, const TraceRecord &rec)
+{
+    int terminal_count = tr->pending.size();
+    if (rec.time < tr->last_time) {
+        fatal("trace is not sorted by time (record %ld)\n", tr->cursor);
+    }
+    if (rec.src < 0 || rec.src >= terminal_count || rec.dst < 0 ||
+        rec.dst >= terminal_count || rec.size < 1) {
+        fatal("bad trace record %ld: src=%d, dst=%d, size=%d\n", tr->cursor,
+              rec.src, rec.dst, rec.size);
+    }
+    tr->last_time = rec.time;
+
+    std::deque<TraceRecord> &q = tr->pending[rec.src];
+    q.push_back(rec);
+    if (q.size() == 1) {
+        Router *src = sim->src_nodes[rec.src];
+        src->sg.next_packet_start = rec.time;
+        long when = std::max(static_cast<long>(rec.time),
+                             curr_time(&sim->eventq) + 1);
+        router_wake(src, when);
+    }
+}
+
+// Dispatch every record within the lookahead window of the next event.  If
+// there are no events left, jump straight to the next record.
+void trace_refill(TraceReader *tr, Sim *sim)
+{
+    if (tr->cursor >= tr->record_count) {
+        return;
+    }
+    long now = eventq_empty(&sim->eventq) ? tr->records[tr->cursor].time
+                                          : next_time(&sim->eventq);
+    long horizon = now + tr->lookahead;
+    if (tr->records[tr->cursor].time > horizon) {
+        return;
+    }
+    while (tr->cursor < tr->record_count &&
+           tr->records[tr->cursor].time <= horizon) {
+        trace_dispatch(tr, sim, tr->records[tr->cursor]);
+        tr->cursor++;
+    }
+    trace_release(tr);
+}
+
+// Returns the next pending record of 'src', or NULL if there is none.
+const TraceRecord *trace_peek(const TraceReader *tr, int src)
+{
+    const std::deque<TraceRecord> &q = tr->pending[src];
+    return q.empty() ? NULL : &q.front();
+}
+
+TraceRecord trace_pop(TraceReader *tr, int src)
+{
+    std::deque<TraceRecord> &q = tr->pending[src];
+    assert(!q.empty());
+    TraceRecord rec = q.front();
+    q.pop_front();
+    return rec;
+}
+
+TraceWriter *trace_writer_open(const char *path)
+{
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        fatal("cannot open '%s' for writing: %s\n", path, strerror(errno));
+    }
+    TraceWriter *tw = new TraceWriter;
+    tw->fp = fp;
+    // Placeholder; the record count is filled in on close.
+    TraceHeader hdr{};
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    return tw;
+}
+
+void trace_writer_put(TraceWriter *tw, TraceRecord rec)
+{
+    tw->records.push_back(rec);
+}
+
+// Write out the records sorted by time, keeping the order of the ones put in
+// the same cycle.
+void trace_writer_close(TraceWriter *tw)
+{
+    std::stable_sort(tw->records.begin(), tw->records.end(),
+                     [](const TraceRecord &a, const TraceRecord &b) {
+                         return a.time < b.time;
+                     });
+    fwrite(tw->records.data(), sizeof(TraceRecord), tw->records.size(),
+           tw->fp);
+
+    TraceHeader hdr{};
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TRACE_VERSION;
+    hdr.record_size = sizeof(TraceRecord);
+    hdr.record_count = tw->records.size();
+    fseek(tw->fp, 0, SEEK_SET);
+    fwrite(&hdr, sizeof(hdr), 1, tw->fp);
+    fclose(tw->fp);
+    delete tw;
+}
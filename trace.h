@@ -0,0 +1,71 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+#include <deque>
+
+// Binary packet trace format.
+//
+// A trace file is a TraceHeader followed by 'record_count' TraceRecords, all
+// in native byte order.  Records must be sorted by time.  The file is read
+// through mmap, so a trace can be much larger than the physical memory.
+// Every record is replayed as a request packet.
+
+#define TRACE_MAGIC "NSIMTRC1"
+#define TRACE_VERSION 1
+// Pages behind the read cursor are released in chunks of this size.
+#define TRACE_RELEASE_CHUNK (16L << 20)
+
+struct TraceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size; // sizeof(TraceRecord)
+    uint64_t record_count;
+};
+
+struct TraceRecord {
+    int64_t time; // cycle # that the packet is injected
+    int32_t src;  // source node ID
+    int32_t dst;  // destination node ID
+    int32_t size; // length of the packet in flits
+    int32_t cls;  // reserved: written as 0, ignored on replay
+};
+
+// Streams the records of a trace file to each source node.  Only records
+// within 'lookahead' cycles of the current simulation time are buffered.
+struct TraceReader {
+    int fd;
+    char *map;       // mmap'd file
+    size_t map_size;
+    const TraceRecord *records;
+    long record_count;
+    long cursor = 0;          // next record to be dispatched
+    long lookahead;           // in cycles
+    size_t released = 0;      // bytes of the map released so far
+    long last_time = 0;       // time of the last dispatched record
+    std::vector<std::deque<TraceRecord>> pending; // per source node
+};
+
+struct Sim;
+
+TraceReader *trace_open(const char *path, int terminal_count, long lookahead);
+void trace_close(TraceReader *tr);
+void trace_refill(TraceReader *tr, Sim *sim);
+const TraceRecord *trace_peek(const TraceReader *tr, int src);
+TraceRecord trace_pop(TraceReader *tr, int src);
+
+// Writes a trace file, e.g. to record the packets of a synthetic run.
+// Records may be put out of time order, as Markov-modulated sources generate
+// packets late when they are busy; they are sorted on close.
+struct TraceWriter {
+    FILE *fp;
+    std::vector<TraceRecord> records;
+};
+
+TraceWriter *trace_writer_open(const char *path);
+void trace_writer_put(TraceWriter *tw, TraceRecord rec);
+void trace_writer_close(TraceWriter *tw);
+
+#endif
@@ -0,0 +1,483 @@
+#include "router.h"
+#include "sim.h"
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+#include <climits>
+
+static const char *traffic_names[TRF_COUNT] = {
+    "uniform",   "designated", "transpose", "bitcomp",  "bitrev",
+    "shuffle",   "tornado",    "neighbor",  "hotspot",  "randperm",
+};
+
+static const char *injection_names[INJ_COUNT] = {
+    "poisson", "bernoulli", "onoff", "mmpp",
+};
+
+TrafficDesc::TrafficDesc(int terminal_count)
+    : type(TRF_UNIFORM_RANDOM), dests(terminal_count)
+{
+}
+
+const char *traffic_str(TrafficType type)
+{
+    assert(0 <= type && type < TRF_COUNT);
+    return traffic_names[type];
+}
+
+// Returns 1 if 's' names a traffic pattern, 0 otherwise.
+int traffic_type_from_str(const char *s, TrafficType *type)
+{
+    for (int i = 0; i < TRF_COUNT; i++) {
+        if (!strcmp(s, traffic_names[i])) {
+            *type = static_cast<TrafficType>(i);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Returns log2(n) if n is a power of two, -1 otherwise.
+static int log2_exact(int n)
+{
+    int bits = 0;
+    if (n <= 0 || (n & (n - 1)) != 0)
+        return -1;
+    while ((1 << bits) < n)
+        bits++;
+    return bits;
+}
+
+static int require_bits(TrafficType type, int terminal_count)
+{
+    int bits = log2_exact(terminal_count);
+    if (bits < 0) {
+        fatal("traffic '%s' requires a power-of-two node count (got %d)\n",
+              traffic_str(type), terminal_count);
+    }
+    return bits;
+}
+
+// Compute the destination of 'src' for the permutation patterns, which map
+// every source to a single fixed destination.
+static int permutation_dest(TrafficType type, TopoDesc td, int terminal_count,
+                            int src)
+{
+    int dest = src;
+
+    switch (type) {
+    case TRF_TRANSPOSE:
+        // Reverse the order of the coordinates, e.g. (x,y) -> (y,x).
+        for (int dir = 0; dir < td.r; dir++) {
+            int component = torus_id_xyz_get(src, td.k, td.r - 1 - dir);
+            dest = torus_id_xyz_set(dest, td.k, dir, component);
+        }
+        break;
+    case TRF_BIT_COMPLEMENT:
+        require_bits(type, terminal_count);
+        dest = ~src & (terminal_count - 1);
+        break;
+    case TRF_BIT_REVERSE: {
+        int bits = require_bits(type, terminal_count);
+        dest = 0;
+        for (int i = 0; i < bits; i++)
+            if (src & (1 << i))
+                dest |= 1 << (bits - 1 - i);
+        break;
+    }
+    case TRF_SHUFFLE: {
+        // Rotate left by one bit.
+        int bits = require_bits(type, terminal_count);
+        dest = ((src << 1) | (src >> (bits - 1))) & (terminal_count - 1);
+        break;
+    }
+    case TRF_TORNADO:
+        // Travel (ceil(k/2) - 1) hops along every dimension.
+        for (int dir = 0; dir < td.r; dir++) {
+            int component = torus_id_xyz_get(src, td.k, dir);
+            component = (component + (td.k + 1) / 2 - 1) % td.k;
+            dest = torus_id_xyz_set(dest, td.k, dir, component);
+        }
+        break;
+    case TRF_NEIGHBOR:
+        // One hop in the positive direction along every dimension.
+        for (int dir = 0; dir < td.r; dir++) {
+            int component = torus_id_xyz_get(src, td.k, dir);
+            dest = torus_id_xyz_set(dest, td.k, dir, (component + 1) % td.k);
+        }
+        break;
+    default:
+        assert(false);
+    }
+
+    assert(0 <= dest && dest < terminal_count);
+    return dest;
+}
+
+// Create a traffic pattern.  Destinations of the deterministic patterns are
+// precomputed into the 'dests' table, so that looking up a destination for a
+// packet is a single table access.
+//
+// TRF_HOTSPOT needs extra parameters; use traffic_hotspot() instead.
+TrafficDesc traffic_create(TrafficType type, TopoDesc td, int terminal_count,
+                           uint64_t seed)
+{
+    assert(type != TRF_HOTSPOT);
+    TrafficDesc trd{terminal_count};
+    trd.type = type;
+
+    switch (type) {
+    case TRF_UNIFORM_RANDOM:
+    case TRF_DESIGNATED:
+        break;
+    case TRF_RANDOM_PERMUTATION: {
+        // Derived from the simulation seed, so that the permutation is the
+        // same across runs.
+        Philox eng(seed, RNG_STREAM_TRAFFIC);
+        for (int i = 0; i < terminal_count; i++)
+            trd.dests[i] = i;
+        std::shuffle(trd.dests.begin(), trd.dests.end(), eng);
+        break;
+    }
+    default:
+        for (int i = 0; i < terminal_count; i++)
+            trd.dests[i] = permutation_dest(type, td, terminal_count, i);
+        break;
+    }
+
+    return trd;
+}
+
+// Every packet goes to one of 'hotspots' with probability 'hotspot_rate', and
+// to a uniform random node otherwise.
+TrafficDesc traffic_hotspot(int terminal_count, std::vector<int> hotspots,
+                            double hotspot_rate)
+{
+    TrafficDesc trd{terminal_count};
+    trd.type = TRF_HOTSPOT;
+    for (int h : hotspots) {
+        if (h < 0 || h >= terminal_count)
+            fatal("hotspot node %d out of range\n", h);
+    }
+    if (hotspots.empty())
+        hotspots.push_back(0);
+    trd.hotspots = hotspots;
+    trd.hotspot_rate = hotspot_rate;
+    return trd;
+}
+
+// Uniformly pick a node other than 'src' with a single draw.
+static int uniform_dest(int src, RandomGenerator &rg)
+{
+    int dest = rg.uni_dist_others(rg.rng);
+    return (dest >= src) ? dest + 1 : dest;
+}
+
+// Pick the destination of the next packet from 'src'.
+int traffic_dest(const TrafficDesc &trd, int src, RandomGenerator &rg)
+{
+    switch (trd.type) {
+    case TRF_UNIFORM_RANDOM:
+        return uniform_dest(src, rg);
+    case TRF_HOTSPOT:
+        if (rg.unit_dist(rg.rng) < trd.hotspot_rate) {
+            std::uniform_int_distribution<size_t> pick(
+                0, trd.hotspots.size() - 1);
+            return trd.hotspots[pick(rg.rng)];
+        }
+        return uniform_dest(src, rg);
+    default:
+        return trd.dests[src];
+    }
+}
+
+const char *injection_str(InjectionType type)
+{
+    assert(0 <= type && type < INJ_COUNT);
+    return injection_names[type];
+}
+
+// Returns 1 if 's' names an injection process, 0 otherwise.
+int injection_type_from_str(const char *s, InjectionType *type)
+{
+    for (int i = 0; i < INJ_COUNT; i++) {
+        if (!strcmp(s, injection_names[i])) {
+            *type = static_cast<InjectionType>(i);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Packets are generated with exponentially distributed gaps of
+// 'mean_interval' cycles between the tail of a packet and the next head.
+InjectionDesc injection_poisson(double mean_interval)
+{
+    InjectionDesc inj;
+    inj.type = INJ_POISSON;
+    inj.mean_interval = mean_interval;
+    return inj;
+}
+
+// Poisson process given as an offered load of 'rate' flits/cycle.  The mean
+// interval is derived from the packet length in injection_setup(), which also
+// checks the rate against the terminal width.
+InjectionDesc injection_poisson_rate(double rate)
+{
+    if (rate <= 0.0) {
+        fatal("injection rate should be positive (got %lf)\n", rate);
+    }
+    InjectionDesc inj;
+    inj.type = INJ_POISSON;
+    inj.rate[0] = rate;
+    return inj;
+}
+
+// A packet is injected in each cycle with a fixed probability, so that the
+// offered load is 'rate' flits/cycle.
+InjectionDesc injection_bernoulli(double rate)
+{
+    InjectionDesc inj = injection_mmpp(1, &rate, NULL);
+    inj.type = INJ_BERNOULLI;
+    return inj;
+}
+
+// Bursty traffic: the source alternates between an off state and an on state
+// that injects at the full rate of 1 flit/cycle.  Bursts last 'burst' cycles
+// on average, and the off periods are sized so that the average offered load
+// is 'rate' flits/cycle.
+InjectionDesc injection_onoff(double rate, double burst)
+{
+    if (rate <= 0.0 || rate >= 1.0) {
+        fatal("on/off injection rate should be in (0, 1) (got %lf)\n", rate);
+    }
+    if (burst < 1.0) {
+        fatal("burst length should be >= 1 (got %lf)\n", burst);
+    }
+    double rates[2] = {0.0, 1.0};
+    double dwells[2] = {burst * (1.0 - rate) / rate, burst};
+    InjectionDesc inj = injection_mmpp(2, rates, dwells);
+    inj.type = INJ_ONOFF;
+    return inj;
+}
+
+// Markov-modulated process that cycles through 'state_count' states, staying
+// in state i for 'dwells[i]' cycles on average and offering 'rates[i]'
+// flits/cycle meanwhile.  'dwells' may be NULL only for a single state.
+InjectionDesc injection_mmpp(int state_count, const double *rates,
+                             const double *dwells)
+{
+    if (state_count < 1 || state_count > MMPP_MAX_STATES) {
+        fatal("MMPP supports 1 to %d states (got %d)\n", MMPP_MAX_STATES,
+              state_count);
+    }
+    InjectionDesc inj;
+    inj.type = INJ_MMPP;
+    inj.state_count = state_count;
+    for (int i = 0; i < state_count; i++) {
+        if (rates[i] < 0.0) {
+            fatal("injection rate should be >= 0 (got %lf)\n", rates[i]);
+        }
+        inj.rate[i] = rates[i];
+        inj.dwell[i] = dwells ? dwells[i] : 0.0;
+        if (state_count > 1 && inj.dwell[i] < 1.0) {
+            fatal("MMPP dwell time should be >= 1 (got %lf)\n", inj.dwell[i]);
+        }
+    }
+    return inj;
+}
+
+// Convert the flit rates and dwell times into per-cycle probabilities.  A
+// source generates at most 'gen_width' flits per cycle, so no rate may exceed
+// it.
+void injection_setup(InjectionDesc *inj, const PacketLenDesc &pl)
+{
+    for (int i = 0; i < inj->state_count; i++) {
+        if (inj->rate[i] > inj->gen_width) {
+            fatal("injection rate should be <= the terminal width %d "
+                  "(got %lf)\n", inj->gen_width, inj->rate[i]);
+        }
+    }
+    double mean_packet_len = packet_len_mean(pl);
+    if (inj->type == INJ_POISSON) {
+        // Each packet takes its generation cycles plus the interval.
+        if (inj->rate[0] > 0.0) {
+            double sum = 0.0, total = 0.0;
+            for (size_t i = 0; i < pl.lens.size(); i++) {
+                long cycles = (pl.lens[i] + inj->gen_width - 1) / inj->gen_width;
+                sum += pl.weights[i] * cycles;
+                total += pl.weights[i];
+            }
+            inj->mean_interval = std::max(
+                0.0, mean_packet_len / inj->rate[0] - sum / total);
+        }
+        return;
+    }
+    for (int i = 0; i < inj->state_count; i++) {
+        inj->inject_prob[i] = std::min(inj->rate[i] / mean_packet_len, 1.0);
+        inj->leave_prob[i] =
+            (inj->state_count > 1) ? 1.0 / inj->dwell[i] : 0.0;
+    }
+}
+
+// Draw the initial state from the stationary distribution, in which the
+// probability of each state is proportional to its dwell time.
+int injection_initial_state(const InjectionDesc &inj, RandomGenerator &rg)
+{
+    if (inj.state_count == 1) {
+        return 0;
+    }
+    double total = 0.0;
+    for (int i = 0; i < inj.state_count; i++) {
+        total += inj.dwell[i];
+    }
+    double u = rg.unit_dist(rg.rng) * total;
+    for (int i = 0; i < inj.state_count - 1; i++) {
+        if (u < inj.dwell[i]) {
+            return i;
+        }
+        u -= inj.dwell[i];
+    }
+    return inj.state_count - 1;
+}
+
+// Number of cycles until the first success of a per-cycle Bernoulli trial
+// with probability 'p', or LONG_MAX if it never succeeds.
+static long geometric_gap(double p, RandomGenerator &rg)
+{
+    if (p <= 0.0) {
+        return LONG_MAX;
+    }
+    if (p >= 1.0) {
+        return 1;
+    }
+    std::geometric_distribution<long> geo(p);
+    return 1 + geo(rg.rng);
+}
+
+// Compute the arrival time of the packet that follows the one that arrived at
+// 'last', updating the process state in '*state'.  Instead of stepping cycle
+// by cycle, jump by geometric gaps: in each state, the next injection and the
+// next state transition race, and only the transitions are iterated.
+//
+// Returns LONG_MAX if the process never injects again, i.e. no state injects.
+long injection_next_arrival(const InjectionDesc &inj, long last, int *state,
+                            RandomGenerator &rg)
+{
+    assert(inj.type != INJ_POISSON);
+    bool silent = true;
+    for (int i = 0; i < inj.state_count; i++) {
+        silent &= inj.inject_prob[i] <= 0.0;
+    }
+    if (silent) {
+        return LONG_MAX;
+    }
+    long t = last;
+    while (true) {
+        long inject_gap = geometric_gap(inj.inject_prob[*state], rg);
+        long leave_gap = geometric_gap(inj.leave_prob[*state], rg);
+        // A single state never leaves, and it injects since not silent.
+        assert(inject_gap != LONG_MAX || leave_gap != LONG_MAX);
+        if (inject_gap <= leave_gap) {
+            // Both in the same cycle: inject first, then leave the state.
+            if (inject_gap == leave_gap) {
+                *state = (*state + 1) % inj.state_count;
+            }
+            return t + inject_gap;
+        }
+        t += leave_gap;
+        *state = (*state + 1) % inj.state_count;
+    }
+}
+
+PacketLenDesc packet_len_fixed(long len)
+{
+    PacketLenDesc pl = packet_len_histogram({len}, {1.0});
+    pl.type = PLEN_FIXED;
+    return pl;
+}
+
+// Request/response mix: 'short_frac' of the packets are 'short_len' flits
+// long, and the rest are 'long_len' flits long.
+PacketLenDesc packet_len_bimodal(long short_len, long long_len,
+                                 double short_frac)
+{
+    if (short_frac < 0.0 || short_frac > 1.0) {
+        fatal("bimodal fraction should be in [0, 1] (got %lf)\n", short_frac);
+    }
+    PacketLenDesc pl = packet_len_histogram({short_len, long_len},
+                                            {short_frac, 1.0 - short_frac});
+    pl.type = PLEN_BIMODAL;
+    return pl;
+}
+
+PacketLenDesc packet_len_histogram(std::vector<long> lens,
+                                   std::vector<double> weights)
+{
+    assert(lens.size() == weights.size());
+    if (lens.empty()) {
+        fatal("empty packet length distribution\n");
+    }
+    double total = 0.0;
+    for (size_t i = 0; i < lens.size(); i++) {
+        if (lens[i] < 1 || weights[i] < 0.0) {
+            fatal("bad packet length %ld with weight %lf\n", lens[i],
+                  weights[i]);
+        }
+        total += weights[i];
+    }
+    if (total <= 0.0) {
+        fatal("packet length weights sum to zero\n");
+    }
+    PacketLenDesc pl;
+    pl.type = PLEN_HISTOGRAM;
+    pl.lens = lens;
+    pl.weights = weights;
+    pl.pick = std::discrete_distribution<int>(weights.begin(), weights.end());
+    return pl;
+}
+
+// Read an empirical histogram from a text file with a "<length> <count>" pair
+// on each line.  Lines starting with '#' are ignored.
+PacketLenDesc packet_len_from_file(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fatal("cannot open '%s'\n", path);
+    }
+    std::vector<long> lens;
+    std::vector<double> weights;
+    char line[256];
+    while (fgets(line, sizeof(line), fp)) {
+        long len;
+        double weight;
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+        if (sscanf(line, "%ld %lf", &len, &weight) != 2) {
+            fatal("%s: bad line '%s'\n", path, line);
+        }
+        lens.push_back(len);
+        weights.push_back(weight);
+    }
+    fclose(fp);
+    return packet_len_histogram(lens, weights);
+}
+
+double packet_len_mean(const PacketLenDesc &pl)
+{
+    double sum = 0.0, total = 0.0;
+    for (size_t i = 0; i < pl.lens.size(); i++) {
+        sum += pl.weights[i] * pl.lens[i];
+        total += pl.weights[i];
+    }
+    return sum / total;
+}
+
+long packet_len_sample(PacketLenDesc &pl, RandomGenerator &rg)
+{
+    if (pl.lens.size() == 1) {
+        return pl.lens[0];
+    }
+    return pl.lens[pl.pick(rg.rng)];
+}